@@ -3,6 +3,8 @@
 #include <iostream>
 #include <boost/lexical_cast.hpp>
 #include <chrono>
+#include <thread>
+#include <vector>
 
 using namespace ten;
 using namespace std::chrono;
@@ -36,6 +38,71 @@ void ring(channel<int> chin, channel<int> chout) {
     }
 }
 
+// pairs of sender and receiver threads passing m messages each
+template <class Channel>
+void cross_thread(const char *name, Channel ch, int pairs, int m) {
+    auto start = high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (int p=0; p<pairs; ++p) {
+        threads.emplace_back(task::spawn_thread([=] {
+            Channel out = ch;
+            for (int i=0; i<m; ++i) {
+                int n = i;
+                out.send(std::move(n));
+            }
+        }));
+        threads.emplace_back(task::spawn_thread([=] {
+            Channel in = ch;
+            for (int i=0; i<m; ++i) {
+                (void)in.recv();
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    auto stop = high_resolution_clock::now();
+    auto ms = duration_cast<milliseconds>(stop - start).count();
+    std::cout << name << " " << pairs << " sender/receiver thread pairs: "
+        << (pairs*m) << " messages in " << ms << "ms, "
+        << (uint64_t)(pairs*m) * 1000 / (ms ? ms : 1) << " msg/s\n";
+}
+
+// same as cross_thread, moving batch messages per lock and wakeup
+template <class Channel>
+void cross_thread_batch(const char *name, Channel ch, int pairs, int m, int batch) {
+    auto start = high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (int p=0; p<pairs; ++p) {
+        threads.emplace_back(task::spawn_thread([=] {
+            Channel out = ch;
+            std::vector<int> items;
+            for (int i=0; i<m; i+=items.size()) {
+                items.clear();
+                for (int j=i; j<m && j<i+batch; ++j) {
+                    items.push_back(j);
+                }
+                out.send_batch(items);
+            }
+        }));
+        threads.emplace_back(task::spawn_thread([=] {
+            Channel in = ch;
+            std::vector<int> items(batch);
+            for (int i=0; i<m; ) {
+                i += in.recv_batch(items.begin(), std::min(batch, m - i));
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    auto stop = high_resolution_clock::now();
+    auto ms = duration_cast<milliseconds>(stop - start).count();
+    std::cout << name << " batches of " << batch << ", " << pairs << " sender/receiver thread pairs: "
+        << (pairs*m) << " messages in " << ms << "ms, "
+        << (uint64_t)(pairs*m) * 1000 / (ms ? ms : 1) << " msg/s\n";
+}
+
 int main(int argc, char *argv[]) {
     return task::main([&] {
         channel<int> chin;
@@ -48,16 +115,29 @@ int main(int argc, char *argv[]) {
         if (argc >= 3) {
             m = boost::lexical_cast<int>(argv[2]);
         }
+        // messages per thread for the cross thread comparison
+        int x = 1000000;
+        if (argc >= 4) {
+            x = boost::lexical_cast<int>(argv[3]);
+        }
         for (int i=0; i<n; ++i) {
             channel<int> chout;
             task::spawn([=] {
-                ring(chin, chout);
+                ::ring(chin, chout);
             });
             chin = chout;
         }
         task::spawn([=] {
             one_ring(chin, chfirst, m, n);
         });
+        kernel::wait_for_tasks();
+
+        for (int pairs : {1, 4}) {
+            cross_thread("channel<int>{1024}", channel<int>{1024}, pairs, x);
+            cross_thread("channel<int, ring<1024>>", channel<int, ten::ring<1024>>{}, pairs, x);
+            cross_thread_batch("channel<int>{1024}", channel<int>{1024}, pairs, x, 64);
+            cross_thread_batch("channel<int, ring<1024>>", channel<int, ten::ring<1024>>{}, pairs, x, 64);
+        }
     });
 }
 
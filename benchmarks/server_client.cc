@@ -1,9 +1,14 @@
 #include "ten/net.hh"
 #include "ten/channel.hh"
+#include <boost/lexical_cast.hpp>
+#include <netinet/tcp.h>
+#include <algorithm>
 #include <iostream>
 #include <unordered_map>
+#include <vector>
 
 using namespace ten;
+using namespace std::chrono;
 
 static void connecter(const address &addr, channel<int> ch) {
     try {
@@ -47,8 +52,93 @@ static void connecter_spawner(const address &addr, const channel<int> &ch) {
     }
 }
 
+// ask the kernel to busy poll the socket too, needs CAP_NET_ADMIN
+static void try_socket_busy_poll(netsock &s, microseconds budget) {
+    if (budget == microseconds::zero()) return;
+    try {
+        s.set_busy_poll(budget);
+    } catch (errorx &e) {}
+}
+
+static void echo_handler(int fd, microseconds busy_poll) {
+    netsock s(fd);
+    s.setsockopt(IPPROTO_TCP, TCP_NODELAY, 1);
+    try_socket_busy_poll(s, busy_poll);
+    char buf[32];
+    for (;;) {
+        ssize_t nr = s.recv(buf, sizeof(buf));
+        if (nr <= 0) break;
+        if (s.send(buf, nr) != nr) break;
+    }
+}
+
+// ping-pong 32 bytes from another thread and report round trip times,
+// both threads busy poll for busy_poll before blocking
+static void round_trips(size_t n, microseconds busy_poll) {
+    kernel::set_busy_poll(busy_poll);
+    address addr{AF_INET};
+    netsock ls(AF_INET, SOCK_STREAM | SOCK_NONBLOCK);
+    ls.bind(addr);
+    ls.listen();
+    ls.getsockname(addr);
+    task echo_task = task::spawn([&] {
+        address client;
+        int fd = ls.accept(client);
+        if (fd != -1) {
+            echo_handler(fd, busy_poll);
+        }
+    });
+    std::vector<kernel::duration> times;
+    times.reserve(n);
+    channel<int> done(1);
+    std::thread client_thread = task::spawn_thread([&] {
+        struct notify {
+            channel<int> &ch;
+            ~notify() { ch.send(0); }
+        } notify_done{done};
+        kernel::set_busy_poll(busy_poll);
+        netsock s(AF_INET, SOCK_STREAM);
+        if (s.connect(addr, milliseconds{100}) != 0) return;
+        s.setsockopt(IPPROTO_TCP, TCP_NODELAY, 1);
+        try_socket_busy_poll(s, busy_poll);
+        char buf[32] = {};
+        for (size_t i=0; i<n; ++i) {
+            const auto start = kernel::clock::now();
+            if (s.send(buf, sizeof(buf)) != sizeof(buf)) break;
+            if (s.recvall(buf, sizeof(buf)) != sizeof(buf)) break;
+            times.push_back(kernel::clock::now() - start);
+        }
+    });
+    // joining the thread right away would block the echo task
+    done.recv();
+    client_thread.join();
+    echo_task.join();
+    kernel::set_busy_poll(kernel::duration::zero());
+    if (times.empty()) {
+        std::cout << "round trips failed\n";
+        return;
+    }
+    std::sort(times.begin(), times.end());
+    auto us = [](kernel::duration d) {
+        return duration_cast<nanoseconds>(d).count() / 1000.0;
+    };
+    std::cout << "round trips: " << times.size()
+        << " busy poll: " << busy_poll.count() << "us"
+        << " p50: " << us(times[times.size() / 2]) << "us"
+        << " p99: " << us(times[times.size() * 99 / 100]) << "us"
+        << " max: " << us(times.back()) << "us\n";
+}
+
 int main(int argc, char *argv[]) {
-    return task::main([] {
+    size_t n = 10000;
+    microseconds busy_poll{0};
+    if (argc >= 2) {
+        busy_poll = microseconds{boost::lexical_cast<uint64_t>(argv[1])};
+    }
+    if (argc >= 3) {
+        n = boost::lexical_cast<size_t>(argv[2]);
+    }
+    return task::main([=] {
         channel<int> ch(1000);
         address addr{AF_INET};
         netsock s(AF_INET, SOCK_STREAM | SOCK_NONBLOCK);
@@ -78,5 +168,7 @@ int main(int argc, char *argv[]) {
         std::cout << std::endl;
         listen_task.cancel();
         connecter_thread.join();
+
+        round_trips(n, busy_poll);
     });
 }
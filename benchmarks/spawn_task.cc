@@ -1,9 +1,14 @@
 #include "ten/task.hh"
 #include <iostream>
+#include <boost/lexical_cast.hpp>
 
 using namespace ten;
 
-int main() {
+int main(int argc, char *argv[]) {
+    // optional stack arena size in stacks
+    if (argc >= 2) {
+        kernel::use_stack_arena(boost::lexical_cast<size_t>(argv[1]));
+    }
     return task::main([] {
         intmax_t count=0;
         try {
@@ -0,0 +1,71 @@
+#include "ten/task.hh"
+#include "ten/task/task_pool.hh"
+#include <iostream>
+#include <boost/lexical_cast.hpp>
+#include <chrono>
+#include <vector>
+
+using namespace ten;
+using namespace std::chrono;
+
+static void report(const char *what, size_t n, high_resolution_clock::time_point start) {
+    auto stop = high_resolution_clock::now();
+    auto us = duration_cast<microseconds>(stop - start).count();
+    std::cout << what << ": " << n << " tasks in " << us << "us, "
+        << (us ? n * 1000000 / us : 0) << " tasks/s\n";
+}
+
+// short lived tasks coming and going among many long lived ones,
+// with and without a task_pool, then all the long lived ones
+// exiting at once, newest first
+int main(int argc, char *argv[]) {
+    size_t live = 20000;
+    size_t churn = 100000;
+    if (argc >= 2) {
+        live = boost::lexical_cast<size_t>(argv[1]);
+    }
+    if (argc >= 3) {
+        churn = boost::lexical_cast<size_t>(argv[2]);
+    }
+    // optional stack arena size in stacks
+    if (argc >= 4) {
+        kernel::use_stack_arena(boost::lexical_cast<size_t>(argv[3]));
+    }
+    return task::main([=] {
+        std::vector<task> tasks;
+        for (size_t i=0; i<live; ++i) {
+            tasks.push_back(task::spawn([] {
+                this_task::sleep_for(hours{1});
+            }));
+        }
+        this_task::yield();
+
+        size_t exited = 0;
+        auto start = high_resolution_clock::now();
+        for (size_t i=0; i<churn; ++i) {
+            task::spawn([&] { ++exited; });
+            if (i % 100 == 99) this_task::yield();
+        }
+        while (exited < churn) this_task::yield();
+        report("spawn and exit", churn, start);
+
+        {
+            task_pool pool{128};
+            exited = 0;
+            start = high_resolution_clock::now();
+            for (size_t i=0; i<churn; ++i) {
+                pool.spawn([&] { ++exited; });
+                if (i % 100 == 99) this_task::yield();
+            }
+            while (exited < churn) this_task::yield();
+            report("task_pool", churn, start);
+        }
+
+        start = high_resolution_clock::now();
+        for (auto i = tasks.rbegin(); i != tasks.rend(); ++i) {
+            i->cancel();
+        }
+        kernel::wait_for_tasks();
+        report("burst exit", live, start);
+    });
+}
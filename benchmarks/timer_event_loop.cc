@@ -1,6 +1,11 @@
 #include "ten/task.hh"
 #include "ten/descriptors.hh"
+#include <boost/lexical_cast.hpp>
 #include <iostream>
+#include <algorithm>
+#include <random>
+#include <memory>
+#include <vector>
 
 using namespace ten;
 using namespace std::chrono;
@@ -21,8 +26,59 @@ static void yield_task() {
     }
 }
 
-int main() {
-    return task::main([] {
+static int64_t ms_since(steady_clock::time_point start) {
+    return duration_cast<milliseconds>(steady_clock::now() - start).count();
+}
+
+// arm, tick with, then cancel ntimers pending timers.
+// deadlines are used so one task can hold all of them.
+static void pending_timers(size_t ntimers) {
+    std::mt19937 rng;
+    std::vector<std::unique_ptr<deadline>> deadlines;
+    deadlines.reserve(ntimers);
+
+    auto start = steady_clock::now();
+    for (size_t i=0; i<ntimers; ++i) {
+        // far enough out that none fire during the run
+        deadlines.emplace_back(new deadline{milliseconds{600000 + rng() % 600000}});
+    }
+    std::cout << "armed " << ntimers << " timers in " << ms_since(start) << "ms\n";
+
+    // every yield goes through the scheduler which ticks the alarm clock
+    uint64_t counter = 0;
+    start = steady_clock::now();
+    while (steady_clock::now() - start < seconds{1}) {
+        this_task::yield();
+        ++counter;
+    }
+    std::cout << "yields/sec with " << ntimers << " pending: " << counter << "\n";
+
+    std::shuffle(begin(deadlines), end(deadlines), rng);
+    start = steady_clock::now();
+    deadlines.clear();
+    std::cout << "canceled " << ntimers << " timers in " << ms_since(start) << "ms\n";
+
+    // timers that do fire, all in one tick
+    start = steady_clock::now();
+    for (size_t i=0; i<ntimers; ++i) {
+        deadlines.emplace_back(new deadline{milliseconds{1 + rng() % 10}});
+    }
+    try {
+        this_task::sleep_for(milliseconds{20});
+    } catch (deadline_reached &e) {}
+    std::cout << "armed and fired " << ntimers << " timers in " << ms_since(start) << "ms\n";
+}
+
+int main(int argc, char *argv[]) {
+    return task::main([&] {
+        if (argc >= 2) {
+            // usage: timer_event_loop <pending timers>, e.g. 1000000
+            size_t ntimers = boost::lexical_cast<size_t>(argv[1]);
+            task::spawn([=] {
+                pending_timers(ntimers);
+            });
+            return;
+        }
         task::spawn(yield_task);
         for (int i=0; i<1000; ++i) {
             task::spawn([] {
@@ -0,0 +1,126 @@
+#include "ten/task.hh"
+#include "ten/task/rendez.hh"
+#include <iostream>
+#include <boost/lexical_cast.hpp>
+#include <chrono>
+#include <vector>
+
+using namespace ten;
+using namespace std::chrono;
+
+// tasks park on a held qutex when done so they don't exit, and with it
+// their scheduler bookkeeping, while the clock is running
+struct waiters {
+    qutex q;
+    rendez r;
+    qutex gate;
+    std::unique_lock<qutex> gate_lock;
+    size_t done = 0;
+
+    waiters() : gate_lock{gate} {}
+
+    void wait_done(size_t n) {
+        while (done < n) this_task::yield();
+    }
+
+    void finish() {
+        gate_lock.unlock();
+        kernel::wait_for_tasks();
+    }
+};
+
+static void report(const char *what, size_t n, high_resolution_clock::time_point start) {
+    auto stop = high_resolution_clock::now();
+    std::cout << what << " " << n << " waiters: "
+        << duration_cast<microseconds>(stop - start).count() << "us\n";
+}
+
+// n tasks sleep on one rendez and are woken with wakeupall, rounds times
+static void rendez_wakeupall(size_t n, size_t rounds) {
+    waiters w;
+    size_t gen = 0;
+    for (size_t i=0; i<n; ++i) {
+        task::spawn([&] {
+            for (size_t r=1; r<=rounds; ++r) {
+                std::unique_lock<qutex> lk{w.q};
+                w.r.sleep(lk, [&] { return gen >= r; });
+                ++w.done;
+            }
+            std::lock_guard<qutex> lk{w.gate};
+        });
+    }
+    this_task::yield();
+    auto start = high_resolution_clock::now();
+    for (size_t r=1; r<=rounds; ++r) {
+        {
+            std::lock_guard<qutex> lk{w.q};
+            gen = r;
+        }
+        w.r.wakeupall();
+        w.wait_done(n * r);
+    }
+    report("rendez wakeupall", n, start);
+    w.finish();
+}
+
+// n tasks sleep on one rendez, then are canceled newest first,
+// so each has to come off the far end of the wait list
+static void rendez_cancel(size_t n) {
+    waiters w;
+    std::vector<task> tasks;
+    for (size_t i=0; i<n; ++i) {
+        tasks.push_back(task::spawn([&] {
+            try {
+                std::unique_lock<qutex> lk{w.q};
+                w.r.sleep(lk, [] { return false; });
+            } catch (task_interrupted &) {}
+            ++w.done;
+            std::lock_guard<qutex> lk{w.gate};
+        }));
+    }
+    this_task::yield();
+    auto start = high_resolution_clock::now();
+    for (auto i = tasks.rbegin(); i != tasks.rend(); ++i) {
+        i->cancel();
+    }
+    w.wait_done(n);
+    report("rendez cancel", n, start);
+    w.finish();
+}
+
+// n tasks take turns with a qutex, rounds times each
+static void qutex_handoff(size_t n, size_t rounds) {
+    waiters w;
+    std::unique_lock<qutex> held{w.q};
+    for (size_t i=0; i<n; ++i) {
+        task::spawn([&] {
+            for (size_t r=0; r<rounds; ++r) {
+                std::lock_guard<qutex> lk{w.q};
+                ++w.done;
+            }
+            std::lock_guard<qutex> lk{w.gate};
+        });
+    }
+    this_task::yield();
+    auto start = high_resolution_clock::now();
+    held.unlock();
+    w.wait_done(n * rounds);
+    report("qutex handoff", n, start);
+    w.finish();
+}
+
+int main(int argc, char *argv[]) {
+    size_t n = 10000;
+    size_t rounds = 10;
+    if (argc >= 2) {
+        n = boost::lexical_cast<size_t>(argv[1]);
+    }
+    if (argc >= 3) {
+        rounds = boost::lexical_cast<size_t>(argv[2]);
+    }
+    return task::main([=] {
+        rendez_wakeupall(n, rounds);
+        rendez_cancel(n);
+        qutex_handoff(n, rounds);
+    });
+}
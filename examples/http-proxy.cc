@@ -2,28 +2,12 @@
 #include "ten/buffer.hh"
 #include "ten/logging.hh"
 #include "ten/net.hh"
-#include "ten/channel.hh"
 #include "ten/http/http_message.hh"
 #include "ten/uri.hh"
 #include <boost/lexical_cast.hpp>
 
 using namespace ten;
 
-void sock_copy(channel<int> c, netsock &a, netsock &b, buffer &buf) {
-    for (;;) {
-        buf.reserve(4*1024);
-        ssize_t nr = a.recv(buf.back(), buf.available());
-        if (nr <= 0) break;
-        buf.commit(nr);
-        ssize_t nw = b.send(buf.front(), buf.size());
-        buf.remove(nw);
-    }
-    DVLOG(3) << "shutting down sock_copy: " << a.s.fd << " to " << b.s.fd;
-    shutdown(b.s.fd, SHUT_WR);
-    a.close();
-    c.send(1);
-}
-
 void send_503_reply(netsock &s) {
     http_response resp{503};
     std::string data = resp.data();
@@ -81,16 +65,9 @@ void proxy_task(int sock) {
             ssize_t nw = s.send(data.data(), data.size(), 0, duration_cast<milliseconds>(seconds{5}));
             (void)nw;
 
-            channel<int> c;
-            task::spawn([&] {
-                sock_copy(c, s, cs, buf);
-            });
-            task::spawn([&] {
-                sock_copy(c, cs, s, buf);
-            });
-            // wait for sock copy tasks to exit
-            c.recv();
-            c.recv();
+            netproxy_stats st = netproxy(s, cs);
+            DVLOG(3) << "tunnel to " << u.host << " done, sent " << st.a_to_b
+                << " received " << st.b_to_a;
             return;
         } else {
             if (u.port == 0) u.port = 80;
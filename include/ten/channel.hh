@@ -4,9 +4,12 @@
 #include "task.hh"
 #include "task/qutex.hh"
 #include "task/rendez.hh"
+#include "mpmc_ring.hh"
 #include <memory>
+#include <atomic>
 #include <queue>
 #include <deque>
+#include <iterator>
 
 namespace ten {
 
@@ -16,6 +19,9 @@ struct channel_closed_error : std::exception {
     }
 };
 
+template <class ...Cases>
+optional<size_t> select_for(optional_timeout ms, Cases &&...cases);
+
 //! send and receive data between tasks in FIFO order
 //
 //! channels can be buffered or unbuffered.
@@ -58,6 +64,15 @@ private:
         // but i don't want to complicate the interface for send/recv
         if (_m->closed) throw channel_closed_error();
     }
+
+    //! wake enough waiters for n items with a single call
+    static void wakeup(rendez &r, size_t n) {
+        if (n == 1) {
+            r.wakeup();
+        } else if (n > 1) {
+            r.wakeupall();
+        }
+    }
 public:
     //! create a new channel
     //! \param capacity number of items to buffer. the default is 0, unbuffered.
@@ -123,38 +138,157 @@ public:
         return item;
     }
 
-    // TODO: rewrite this
-#if 0
-    //! timed receive data
-    bool timed_recv(T &item, unsigned int ms) {
-        std::unique_lock<qutex> l(m->qtx);
-        bool unbuffered = m->capacity == 0;
+    //! send [first, last) holding the lock as long as there is room
+    //
+    //! waiting receivers are woken once per run of items instead of once
+    //! per item. if the channel closes part way through, the items
+    //! already sent stay sent and channel_closed_error is thrown.
+    //! \return number of items sent
+    template <class InputIt>
+    size_t send_batch(InputIt first, InputIt last) {
+        std::unique_lock<qutex> l(_m->qtx);
+        size_t n = 0;
+        size_t unwoken = 0;
+        while (first != last) {
+            while (_m->is_full() && !_m->closed) {
+                // receivers have to make room before we can continue
+                wakeup(_m->not_empty, unwoken);
+                unwoken = 0;
+                _m->not_full.sleep(l);
+            }
+            check_closed();
+            do {
+                _m->queue.push(std::move(*first));
+                ++_m->unread;
+                ++first;
+                ++n;
+                ++unwoken;
+            } while (first != last && !_m->is_full());
+        }
+        wakeup(_m->not_empty, unwoken);
+        return n;
+    }
+
+    //! send every item in range
+    template <class Range>
+    size_t send_batch(Range &&items) {
+        return send_batch(std::begin(items), std::end(items));
+    }
+
+    //! receive up to max items into out, waiting for at least one
+    //
+    //! on an unbuffered channel this lets up to max senders through.
+    //! \return number of items received
+    template <class OutputIt>
+    size_t recv_batch(OutputIt out, size_t max) {
+        if (max == 0) return 0;
+        std::unique_lock<qutex> l(_m->qtx);
+        bool unbuffered = _m->capacity == 0;
         if (unbuffered) {
-            // grow the capacity for a single item
-            m->capacity = 1;
-            // unblock sender
-            m->not_full.wakeup();
+            // grow the capacity for the whole batch
+            _m->capacity = max;
+            _m->not_full.wakeupall();
         }
-        while (m->is_empty() && !m->closed) {
-            if (!m->not_empty.sleep_for(l, ms)) return false;
+        while (_m->is_empty() && !_m->closed) {
+            _m->not_empty.sleep(l);
         }
-        if (m->unread == 0) {
+        if (_m->unread == 0) {
             check_closed();
         }
 
-        // we don't pop_back because the item will just get overwritten
-        // when the circular buffer wraps around
-        item = m->container[--m->unread];
+        size_t n = 0;
+        while (n < max && !_m->is_empty()) {
+            --_m->unread;
+            *out = std::move(_m->queue.front());
+            ++out;
+            _m->queue.pop();
+            ++n;
+        }
         if (unbuffered) {
-            // shrink capacity again so sends will block
-            // waiting for recv
-            m->capacity = 0;
+            _m->capacity = 0;
         } else {
-            m->not_full.wakeup();
+            wakeup(_m->not_full, n);
+        }
+        return n;
+    }
+
+    //! select case receiving into item
+    class recv_op : public select_case {
+        std::shared_ptr<impl> _m;
+        T &_item;
+        bool _grew = false;
+    public:
+        recv_op(const channel &c, T &item) : _m(c._m), _item(item) {}
+
+        qutex &lock() override { return _m->qtx; }
+        rendez &waitq() override { return _m->not_empty; }
+
+        bool try_complete() override {
+            if (_m->is_empty()) {
+                if (_m->closed) throw channel_closed_error();
+                return false;
+            }
+            --_m->unread;
+            _item = std::move(_m->queue.front());
+            _m->queue.pop();
+            if (_m->capacity != 0) {
+                _m->not_full.wakeup();
+            }
+            return true;
         }
-        return true;
+
+        void parking() override {
+            if (_m->capacity == 0) {
+                // like recv, let one unbuffered sender through
+                _m->capacity = 1;
+                _grew = true;
+                _m->not_full.wakeup();
+            }
+        }
+
+        void unparking() override {
+            if (_grew) {
+                _m->capacity = 0;
+                _grew = false;
+                // a sender we let through may have finished after another
+                // case won, its send already returned, so hand the item
+                // on to the next receiver instead of leaving it unread
+                if (!_m->is_empty()) {
+                    _m->not_empty.wakeup();
+                }
+            }
+        }
+    };
+
+    //! select case sending item, which is only moved from if this case is chosen
+    class send_op : public select_case {
+        std::shared_ptr<impl> _m;
+        T &_item;
+    public:
+        send_op(const channel &c, T &item) : _m(c._m), _item(item) {}
+
+        qutex &lock() override { return _m->qtx; }
+        rendez &waitq() override { return _m->not_full; }
+
+        bool try_complete() override {
+            if (_m->closed) throw channel_closed_error();
+            if (_m->is_full()) return false;
+            _m->queue.push(std::move(_item));
+            ++_m->unread;
+            _m->not_empty.wakeup();
+            return true;
+        }
+    };
+
+    //! case for select() that receives into item
+    recv_op recv_case(T &item) { return recv_op{*this, item}; }
+    //! case for select() that sends item
+    send_op send_case(T &&item) { return send_op{*this, item}; }
+
+    //! receive data, waiting at most ms. \return false on timeout
+    bool timed_recv(T &item, optional_timeout ms) {
+        return (bool)select_for(ms, recv_case(item));
     }
-#endif
 
     bool empty() {
         return unread() == 0;
@@ -190,6 +324,291 @@ public:
 
 };
 
+//! tag selecting a channel backed by a lock-free ring of N slots
+//
+//! channel<T, ring<N>> sends and receives without locking unless the
+//! ring is full or empty, then it parks on a rendez like channel<T>.
+//! it is always buffered, N must be a power of two.
+template <size_t N> struct ring {};
+
+template <typename T, size_t N> class channel<T, ring<N>> {
+private:
+    struct impl {
+        mpmc_ring<T, N> items;
+        std::atomic<bool> closed;
+        // tasks parked or about to park, only incremented under qtx
+        std::atomic<uint32_t> recv_waiters;
+        std::atomic<uint32_t> send_waiters;
+        qutex qtx;
+        rendez not_empty;
+        rendez not_full;
+
+        impl() : closed{false}, recv_waiters{0}, send_waiters{0} {}
+        impl(const impl &) = delete;
+        impl &operator =(const impl &) = delete;
+    };
+
+    struct waiting {
+        std::atomic<uint32_t> &count;
+
+        explicit waiting(std::atomic<uint32_t> &count_) : count(count_) {
+            count.fetch_add(1);
+            // pairs with the fence in wake()
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        ~waiting() { count.fetch_sub(1); }
+    };
+
+private:
+    std::shared_ptr<impl> _m;
+    bool _autoclose;
+
+    void check_closed() {
+        if (_m->closed.load()) throw channel_closed_error();
+    }
+
+    void wake(std::atomic<uint32_t> &waiters, rendez &r, bool all=false) {
+        // either we see the waiter or its retry sees our push/pop
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) > 0) {
+            // waiters hold qtx from retrying until they are in the rendez
+            std::lock_guard<qutex> l(_m->qtx);
+            if (all) {
+                r.wakeupall();
+            } else {
+                r.wakeup();
+            }
+        }
+    }
+
+    void send_slow(T &&p) {
+        std::unique_lock<qutex> l(_m->qtx);
+        waiting w(_m->send_waiters);
+        for (;;) {
+            check_closed();
+            if (_m->items.push(std::move(p))) break;
+            _m->not_full.sleep(l);
+        }
+    }
+
+    void recv_slow(optional<T> &item) {
+        std::unique_lock<qutex> l(_m->qtx);
+        waiting w(_m->recv_waiters);
+        for (;;) {
+            if (_m->items.pop(item)) break;
+            // closed channels are drained before throwing
+            check_closed();
+            _m->not_empty.sleep(l);
+        }
+    }
+public:
+    explicit channel(bool autoclose=false)
+        : _m(std::make_shared<impl>()), _autoclose(autoclose)
+    {
+    }
+
+    channel(const channel &other) : _m(other._m), _autoclose(false) {}
+    channel &operator = (const channel &other) {
+        _m = other._m;
+        _autoclose = false;
+        return *this;
+    }
+
+    ~channel() {
+        if (_autoclose) {
+            close();
+        }
+    }
+
+    //! send data, \return approximate number of unread items before this one
+    size_t send(T &&p) {
+        check_closed();
+        size_t ret = _m->items.size();
+        if (!_m->items.push(std::move(p))) {
+            send_slow(std::move(p));
+            ret = N;
+        }
+        wake(_m->recv_waiters, _m->not_empty);
+        return ret;
+    }
+
+    //! receive data
+    T recv() {
+        optional<T> item;
+        if (!_m->items.pop(item)) {
+            recv_slow(item);
+        }
+        wake(_m->send_waiters, _m->not_full);
+        return std::move(*item);
+    }
+
+    //! send [first, last), waking receivers once instead of per item
+    //
+    //! if the channel closes part way through, the items already sent
+    //! stay sent and channel_closed_error is thrown.
+    //! \return number of items sent
+    template <class InputIt>
+    size_t send_batch(InputIt first, InputIt last) {
+        size_t n = 0;
+        for (; first != last; ++first, ++n) {
+            if (_m->closed.load()) {
+                if (n) wake(_m->recv_waiters, _m->not_empty, n > 1);
+                throw channel_closed_error();
+            }
+            if (!_m->items.push(std::move(*first))) {
+                // full, receivers have to make room first
+                wake(_m->recv_waiters, _m->not_empty, true);
+                send_slow(std::move(*first));
+            }
+        }
+        if (n) wake(_m->recv_waiters, _m->not_empty, n > 1);
+        return n;
+    }
+
+    //! send every item in range
+    template <class Range>
+    size_t send_batch(Range &&items) {
+        return send_batch(std::begin(items), std::end(items));
+    }
+
+    //! receive up to max items into out, waiting for at least one
+    //! \return number of items received
+    template <class OutputIt>
+    size_t recv_batch(OutputIt out, size_t max) {
+        if (max == 0) return 0;
+        optional<T> item;
+        if (!_m->items.pop(item)) {
+            recv_slow(item);
+        }
+        size_t n = 0;
+        do {
+            *out = std::move(*item);
+            ++out;
+            ++n;
+        } while (n < max && _m->items.pop(item));
+        wake(_m->send_waiters, _m->not_full, n > 1);
+        return n;
+    }
+
+    //! select case receiving into item
+    class recv_op : public select_case {
+        std::shared_ptr<impl> _m;
+        T &_item;
+    public:
+        recv_op(const channel &c, T &item) : _m(c._m), _item(item) {}
+
+        qutex &lock() override { return _m->qtx; }
+        rendez &waitq() override { return _m->not_empty; }
+
+        bool try_complete() override {
+            optional<T> item;
+            if (!_m->items.pop(item)) {
+                if (_m->closed.load()) throw channel_closed_error();
+                return false;
+            }
+            _item = std::move(*item);
+            // we hold qtx, so wake() would deadlock. parked senders
+            // can't be between counting themselves and sleeping
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (_m->send_waiters.load(std::memory_order_relaxed) > 0) {
+                _m->not_full.wakeup();
+            }
+            return true;
+        }
+
+        void parking() override {
+            _m->recv_waiters.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        void unparking() override { _m->recv_waiters.fetch_sub(1); }
+    };
+
+    //! select case sending item, which is only moved from if this case is chosen
+    class send_op : public select_case {
+        std::shared_ptr<impl> _m;
+        T &_item;
+    public:
+        send_op(const channel &c, T &item) : _m(c._m), _item(item) {}
+
+        qutex &lock() override { return _m->qtx; }
+        rendez &waitq() override { return _m->not_full; }
+
+        bool try_complete() override {
+            if (_m->closed.load()) throw channel_closed_error();
+            if (!_m->items.push(std::move(_item))) return false;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (_m->recv_waiters.load(std::memory_order_relaxed) > 0) {
+                _m->not_empty.wakeup();
+            }
+            return true;
+        }
+
+        void parking() override {
+            _m->send_waiters.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        void unparking() override { _m->send_waiters.fetch_sub(1); }
+    };
+
+    //! case for select() that receives into item
+    recv_op recv_case(T &item) { return recv_op{*this, item}; }
+    //! case for select() that sends item
+    send_op send_case(T &&item) { return send_op{*this, item}; }
+
+    //! receive data, waiting at most ms. \return false on timeout
+    bool timed_recv(T &item, optional_timeout ms) {
+        return (bool)select_for(ms, recv_case(item));
+    }
+
+    bool empty() {
+        return _m->items.empty();
+    }
+
+    //! \return approximate number of unread items
+    size_t unread() {
+        return _m->items.size();
+    }
+
+    bool is_closed() {
+        return _m->closed.load();
+    }
+
+    void close() {
+        std::lock_guard<qutex> l(_m->qtx);
+        _m->closed.store(true);
+        // wake up all users of channel
+        _m->not_empty.wakeupall();
+        _m->not_full.wakeupall();
+    }
+
+    void clear() {
+        optional<T> item;
+        while (_m->items.pop(item)) {}
+        std::lock_guard<qutex> l(_m->qtx);
+        _m->not_full.wakeupall();
+    }
+};
+
+//! wait for the first of several channel operations
+//
+//! cases come from channel::recv_case and channel::send_case.
+//! when more than one is ready the first listed wins.
+//! \return index of the case that completed
+template <class ...Cases>
+size_t select(Cases &&...cases) {
+    select_case *cs[] = {&cases...};
+    return *select_wait(cs, sizeof...(cases), nullopt);
+}
+
+//! select, waiting at most ms. \return nullopt on timeout
+template <class ...Cases>
+optional<size_t> select_for(optional_timeout ms, Cases &&...cases) {
+    select_case *cs[] = {&cases...};
+    optional<kernel::time_point> when;
+    if (ms) when.emplace(kernel::now() + *ms);
+    return select_wait(cs, sizeof...(cases), when);
+}
+
 } // end namespace ten
 
 #endif // LIBTEN_CHANNEL_HH
@@ -33,6 +33,10 @@ inline bool io_not_ready(int e = errno) {
 //! \file
 //! contains wrappers around most fd based apis
 
+//! called by fd_base::close before the fd is closed, so an epoll
+//! registration kept by netpersist doesn't outlive the fd number
+void fd_closing(int fd) noexcept;
+
 //! base class for other file descriptors
 //
 //! contains methods common to most file descriptors
@@ -122,6 +126,7 @@ struct fd_base {
     void close() noexcept {
         // man 2 close says close can result in EBADF, EIO, and EINTR
         // Linux and any thread-safe OS will not return EINTR, but we check just in case
+        fd_closing(fd);
         if (::close(fd) == -1) {
             if (errno == EINTR) {
                 saved_backtrace bt;
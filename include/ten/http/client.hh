@@ -119,17 +119,19 @@ public:
 
             http_response resp(&r);
 
-            std::string data = r.data();
-            if (r.body.size() > 0) {
-                data += r.body;
-            }
-            ssize_t nw = _sock.send(data.data(), data.size(), 0, timeout);
+            const std::string data = r.data();
+            iovec iov[2] = {
+                {const_cast<char *>(data.data()), data.size()},
+                {const_cast<char *>(r.body.data()), r.body.size()}
+            };
+            const size_t len = data.size() + r.body.size();
+            ssize_t nw = _sock.sendv(iov, r.body.empty() ? 1 : 2, 0, timeout);
             if (nw < 0) {
                 throw http_send_error{};
             }
-            else if ((size_t)nw != data.size()) {
+            else if ((size_t)nw != len) {
                 std::ostringstream ss;
-                ss << "short write: " << nw << " < " << data.size();
+                ss << "short write: " << nw << " < " << len;
                 throw http_error(ss.str().c_str());
             }
 
@@ -12,6 +12,7 @@
 #include "ten/task.hh"
 #include "ten/error.hh"
 #include "ten/optional.hh"
+#include "ten/descriptors.hh"
 
 namespace ten {
 
@@ -44,7 +45,8 @@ extern const std::string
     Content_Length,
     Content_Type, text_plain, app_json, app_json_utf8, app_octet_stream,
     Content_Encoding, identity,
-    Cache_Control, no_cache;
+    Cache_Control, no_cache,
+    Range, Content_Range, Accept_Ranges, bytes;
 }
 
 //! http headers
@@ -265,6 +267,19 @@ struct http_response : http_base {
     status_t status_code {};
     bool guillotine {};  // return only the head
 
+    //! a body sent straight from a file or pipe instead of from body
+    struct file_range {
+        std::shared_ptr<fd_base> fd;
+        //! where the body starts in the file, and its length
+        off_t offset = 0;
+        size_t length = 0;
+        //! size of the whole file, Range requests are only
+        //! honored for regular files
+        size_t size = 0;
+        bool seekable = false;
+    };
+    optional<file_range> file_body;
+
     http_response(status_t status_code_ = 200,
                   http_headers headers_ = {},
                   http_version version_ = default_http_version)
@@ -289,8 +304,17 @@ struct http_response : http_base {
         super::clear();
         status_code = {};
         guillotine = {};
+        file_body = nullopt;
     }
 
+    //! send length bytes of fd from offset as the body, with sendfile
+    //! for files and splice for pipes, see http_exchange::send_response.
+    //! length defaults to the rest of a regular file
+    void set_file_body(std::shared_ptr<fd_base> fd,
+                       off_t offset = 0,
+                       optional<size_t> length = nullopt,
+                       optional<std::string> content_type = nullopt);
+
     const std::string &reason() const;
 
     void parser_init(struct http_parser *p);
@@ -28,12 +28,16 @@ struct http_exchange {
     bool resp_sent {false};
     std::chrono::steady_clock::time_point start;
     log_func_t log_func;
+    //! limits each wait while sending a file body
+    optional_timeout timeout_ms;
 
-    http_exchange(http_request &req_, netsock &sock_, const log_func_t &log_func_)
+    http_exchange(http_request &req_, netsock &sock_, const log_func_t &log_func_,
+            optional_timeout timeout_ms_=nullopt)
         : req(req_),
           sock(sock_),
           start(std::chrono::steady_clock::now()),
-          log_func(log_func_)
+          log_func(log_func_),
+          timeout_ms(timeout_ms_)
         {}
 
     http_exchange(const http_exchange &) = delete;
@@ -67,10 +71,59 @@ struct http_exchange {
         return tmp.compose();
     }
 
+    enum class range_result { none, ok, unsatisfiable };
+
+    //! parse a single "bytes=" range of a body size bytes long into the
+    //! inclusive first and last byte. multiple ranges aren't supported
+    //! and are treated like a malformed range, which is ignored
+    static range_result parse_range(const std::string &spec, size_t size,
+            size_t &first, size_t &last)
+    {
+        static const std::string prefix{"bytes="};
+        if (spec.compare(0, prefix.size(), prefix) != 0) return range_result::none;
+        const char *p = spec.c_str() + prefix.size();
+        if (strchr(p, ',')) return range_result::none;
+        const char *dash = strchr(p, '-');
+        if (!dash) return range_result::none;
+        // too big saturates, which is past the end of any body
+        auto number = [](const char *b, const char *e, size_t &n) {
+            if (b == e) return false;
+            n = 0;
+            for (; b != e; ++b) {
+                if (*b < '0' || *b > '9') return false;
+                const size_t d = *b - '0';
+                n = n > (SIZE_MAX - d) / 10 ? SIZE_MAX : n * 10 + d;
+            }
+            return true;
+        };
+        const char *end = p + strlen(p);
+        if (p == dash) {
+            // the last n bytes
+            size_t n;
+            if (!number(dash + 1, end, n)) return range_result::none;
+            if (n == 0 || size == 0) return range_result::unsatisfiable;
+            first = size - std::min(n, size);
+            last = size - 1;
+            return range_result::ok;
+        }
+        if (!number(p, dash, first)) return range_result::none;
+        if (dash + 1 == end) {
+            last = size - 1;
+        } else if (!number(dash + 1, end, last) || last < first) {
+            return range_result::none;
+        }
+        if (first >= size) return range_result::unsatisfiable;
+        last = std::min(last, size - 1);
+        return range_result::ok;
+    }
+
     //! send response to this request
     ssize_t send_response() {
         if (resp_sent) return 0;
         resp_sent = true;
+        if (resp.file_body) {
+            apply_range();
+        }
         // TODO: Content-Length might be good to add to normal responses,
         //    but only if Transfer-Encoding isn't chunked?
         if (resp.status_code >= 400 && resp.status_code <= 599
@@ -95,14 +148,66 @@ struct http_exchange {
                 resp.set(hs::Connection, hs::close);
         }
 
-        auto data = resp.data();
-        if (!resp.body.empty() && req.method != hs::HEAD) {
-            data += resp.body;
+        const auto data = resp.data();
+        if (resp.file_body) {
+            // the kernel moves the body straight from the file
+            const auto &f = *resp.file_body;
+            const int flags = req.method != hs::HEAD ? MSG_MORE : 0;
+            ssize_t nw = sock.send(data.data(), data.size(), flags, timeout_ms);
+            if (nw == (ssize_t)data.size()) {
+                if (req.method == hs::HEAD) return nw;
+                ssize_t nf = netsendfile(sock.s.fd, f.fd->fd, f.offset, f.length, timeout_ms);
+                if (nf == (ssize_t)f.length) return nw + nf;
+                // the file ended short of the Content-Length already sent
+                if (nf >= 0) errno = EIO;
+            }
+            // the client can't tell where this response ends anymore
+            const int err = errno;
+            VLOG(1) << "closing http connection on " << sock.s.fd
+                << " after a failed file response: " << strerror(err);
+            sock.close();
+            errno = err;
+            return -1;
         }
-        ssize_t nw = sock.send(data.data(), data.size());
+        // headers and body go out together without joining them
+        iovec iov[2] = {
+            {const_cast<char *>(data.data()), data.size()},
+            {const_cast<char *>(resp.body.data()), resp.body.size()}
+        };
+        const size_t iovcnt = (!resp.body.empty() && req.method != hs::HEAD) ? 2 : 1;
+        ssize_t nw = sock.sendv(iov, iovcnt);
         return nw;
     }
 
+    //! honor a Range request for a regular file body
+    void apply_range() {
+        auto &f = *resp.file_body;
+        if (!f.seekable || resp.status_code != 200) return;
+        resp.set(hs::Accept_Ranges, hs::bytes);
+        const auto range = req.get(hs::Range);
+        if (!range) return;
+        size_t first = 0;
+        size_t last = 0;
+        switch (parse_range(*range, f.length, first, last)) {
+        case range_result::none:
+            break;
+        case range_result::unsatisfiable:
+            resp.status_code = 416;
+            resp.set(hs::Content_Range, "bytes */" + std::to_string(f.length));
+            resp.set(hs::Content_Length, 0);
+            resp.file_body = nullopt;
+            break;
+        case range_result::ok:
+            resp.status_code = 206;
+            resp.set(hs::Content_Range, "bytes " + std::to_string(first) + "-"
+                    + std::to_string(last) + "/" + std::to_string(f.length));
+            f.offset += first;
+            f.length = last - first + 1;
+            resp.set(hs::Content_Length, f.length);
+            break;
+        }
+    }
+
     //! the ip of the host making the request
     //! might use the X-Forwarded-For header
     optional<std::string> agent_ip(bool use_xff=false) const {
@@ -224,7 +329,7 @@ private:
                 if (req.complete) {
                     DVLOG(4) << req.data();
                     // handle http exchange (request -> response)
-                    http_exchange ex(req, s, _log_func);
+                    http_exchange ex(req, s, _log_func, _recv_timeout_ms);
                     if (!nodelay_set && !req.close_after()) {
                         // this is likely a persistent connection, so low-latency sending is worth the overh
                         s.setsockopt(IPPROTO_TCP, TCP_NODELAY, 1);
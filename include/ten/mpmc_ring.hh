@@ -0,0 +1,140 @@
+#ifndef LIBTEN_MPMC_RING_HH
+#define LIBTEN_MPMC_RING_HH
+
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include "ten/optional.hh"
+
+namespace ten {
+// bounded multi-producer multi-consumer queue
+// http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+// by dmitry vyukov
+// each slot has a sequence number that says whose turn it is,
+// so producers and consumers only contend on their own position counter.
+// N must be a power of two.
+
+template <typename T, size_t N, size_t CACHE_LINE_SIZE=64>
+struct mpmc_ring {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "mpmc_ring<T, N> requires N to be a power of two");
+private:
+    static constexpr size_t mask = N - 1;
+
+    struct cell {
+        std::atomic<size_t> seq;
+        typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage;
+
+        T *value() { return reinterpret_cast<T *>(&storage); }
+    };
+private:
+    char pad0[CACHE_LINE_SIZE];
+    // shared among producers
+    std::atomic<size_t> _enqueue_pos;
+    char pad1[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    // shared among consumers
+    std::atomic<size_t> _dequeue_pos;
+    char pad2[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    cell _cells[N];
+public:
+    mpmc_ring() : _enqueue_pos{0}, _dequeue_pos{0} {
+        for (size_t i=0; i<N; ++i) {
+            _cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    mpmc_ring(const mpmc_ring &) = delete;
+    mpmc_ring &operator = (const mpmc_ring &) = delete;
+
+    ~mpmc_ring() {
+        // nobody else can be using it now, destroy what was never popped
+        const size_t end = _enqueue_pos.load(std::memory_order_relaxed);
+        for (size_t pos = _dequeue_pos.load(std::memory_order_relaxed); pos != end; ++pos) {
+            _cells[pos & mask].value()->~T();
+        }
+    }
+
+    //! false if full
+    template <typename U>
+    bool push(U &&v) {
+        cell *c;
+        size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            c = &_cells[pos & mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = _enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        new (c->value()) T(std::forward<U>(v));
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    //! false if empty
+    bool pop(T &result) {
+        size_t pos;
+        cell *c = claim(pos);
+        if (c == nullptr) return false;
+        result = std::move(*c->value());
+        release(c, pos);
+        return true;
+    }
+
+    //! false if empty, for T without a default constructor
+    bool pop(optional<T> &result) {
+        size_t pos;
+        cell *c = claim(pos);
+        if (c == nullptr) return false;
+        result.emplace(std::move(*c->value()));
+        release(c, pos);
+        return true;
+    }
+
+    //! approximate when called concurrently with push/pop
+    size_t size() const {
+        size_t d = _dequeue_pos.load(std::memory_order_relaxed);
+        size_t e = _enqueue_pos.load(std::memory_order_relaxed);
+        return e > d ? e - d : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    static constexpr size_t capacity() { return N; }
+private:
+    cell *claim(size_t &pos) {
+        pos = _dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell *c = &_cells[pos & mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0) {
+                if (_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    return c;
+                }
+            } else if (dif < 0) {
+                return nullptr;
+            } else {
+                pos = _dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void release(cell *c, size_t pos) {
+        c->value()->~T();
+        // the slot is free for the producer one lap ahead
+        c->seq.store(pos + mask + 1, std::memory_order_release);
+    }
+};
+
+} // ten
+
+#endif // LIBTEN_MPMC_RING_HH
@@ -0,0 +1,65 @@
+#ifndef LIBTEN_MPSC_QUEUE_HH
+#define LIBTEN_MPSC_QUEUE_HH
+
+#include <atomic>
+#include <cstddef>
+
+namespace ten {
+// intrusive multi-producer single-consumer queue
+// producers push onto a lock-free stack, the consumer takes the
+// whole stack at once and reverses it, so nothing is allocated
+// and there is no ABA problem because nobody pops single items.
+// T links through its Next member, so an item can only be in one
+// queue at a time and must outlive its stay in the queue.
+
+template <typename T, T *T::*Next>
+struct mpsc_queue {
+private:
+    std::atomic<T *> _head;
+public:
+    mpsc_queue() : _head{nullptr} {}
+
+    mpsc_queue(const mpsc_queue &) = delete;
+    mpsc_queue &operator = (const mpsc_queue &) = delete;
+
+    //! any thread
+    void push(T *t) {
+        T *head = _head.load(std::memory_order_relaxed);
+        do {
+            t->*Next = head;
+        } while (!_head.compare_exchange_weak(head, t,
+                    std::memory_order_seq_cst, std::memory_order_relaxed));
+    }
+
+    //! consumer only, calls f(T *) for every item in push order
+    //! \return number of items
+    template <class Function>
+    size_t drain(Function f) {
+        T *t = _head.exchange(nullptr, std::memory_order_acquire);
+        // newest first, reverse it
+        T *oldest = nullptr;
+        while (t) {
+            T *next = t->*Next;
+            t->*Next = oldest;
+            oldest = t;
+            t = next;
+        }
+        size_t n = 0;
+        while (oldest) {
+            T *next = oldest->*Next;
+            oldest->*Next = nullptr;
+            f(oldest);
+            oldest = next;
+            ++n;
+        }
+        return n;
+    }
+
+    bool empty() const {
+        return _head.load(std::memory_order_seq_cst) == nullptr;
+    }
+};
+
+} // ten
+
+#endif // LIBTEN_MPSC_QUEUE_HH
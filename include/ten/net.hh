@@ -4,10 +4,12 @@
 #include "ten/thread_guard.hh"
 #include "ten/descriptors.hh"
 #include "ten/task.hh"
+#include "ten/task/task_pool.hh"
 #include "ten/backoff.hh"
 #include <chrono_io>
 #include <memory>
 #include <thread>
+#include <sys/uio.h>
 
 namespace ten {
 
@@ -27,6 +29,27 @@ int netaccept(int fd, address &addr, int flags, optional_timeout ms);
 ssize_t netrecv(int fd, void *buf, size_t len, int flags, optional_timeout ms);
 //! task friendly send
 ssize_t netsend(int fd, const void *buf, size_t len, int flags, optional_timeout ms);
+//! task friendly recvmsg into several buffers, like netrecv
+ssize_t netrecvv(int fd, const iovec *iov, size_t iovcnt, int flags, optional_timeout ms);
+//! task friendly sendmsg of several buffers without joining them,
+//! keeps going after partial writes until all is sent, like netsend
+ssize_t netsendv(int fd, const iovec *iov, size_t iovcnt, int flags, optional_timeout ms);
+//! task friendly send of len bytes from in_fd to socket fd without copying
+//! them through user space, with sendfile from offset for files and splice
+//! for pipes, where offset is ignored. returns bytes sent like netsend
+ssize_t netsendfile(int fd, int in_fd, off_t offset, size_t len, optional_timeout ms);
+//! task friendly move of everything read from socket from to socket to with
+//! splice through a pipe, without copying it through user space. adds to moved
+//! as bytes are written, so another task can watch it. at the end of from,
+//! shuts down writing on to and returns 0. ms limits each wait for either side.
+//! returns -1 with errno set on errors and timeouts
+int netsplice(int from, int to, optional_timeout ms, uint64_t &moved);
+//! keep fd registered edge triggered with this thread's epoll, saving
+//! epoll_ctl calls on every wait. only for fds read and written until EAGAIN.
+//! closing fd through fd_base from any thread undoes it, a raw ::close doesn't
+void netpersist(int fd);
+//! undo netpersist early, in the thread that called it
+void netforget(int fd);
 
 //! pure-virtual wrapper around socket_fd
 class sockbase {
@@ -86,6 +109,14 @@ public:
         s.setsockopt(level, optname, optval);
     }
 
+    //! have the kernel busy poll the device queue for up to budget when a
+    //! read finds nothing, with SO_BUSY_POLL. going above the
+    //! net.core.busy_read sysctl needs CAP_NET_ADMIN. throws errorx on failure.
+    //! see kernel::set_busy_poll for the scheduler side
+    void set_busy_poll(std::chrono::microseconds budget) {
+        setsockopt(SOL_SOCKET, SO_BUSY_POLL, static_cast<int>(budget.count()));
+    }
+
     virtual void dial(const char *addr,
             uint16_t port,
             optional_timeout timeout_ms=nullopt) = 0;
@@ -111,6 +142,41 @@ public:
             optional_timeout timeout_ms = nullopt)
         __attribute__((warn_unused_result)) = 0;
 
+    //! receive into several buffers, filling them in order.
+    //! the default just receives into the first non-empty one
+    virtual ssize_t recvv(const iovec *iov,
+            size_t iovcnt,
+            int flags=0,
+            optional_timeout timeout_ms = nullopt)
+        __attribute__((warn_unused_result))
+    {
+        for (size_t i=0; i<iovcnt; ++i) {
+            if (iov[i].iov_len) {
+                return this->recv(iov[i].iov_base, iov[i].iov_len, flags, timeout_ms);
+            }
+        }
+        return 0;
+    }
+
+    //! send several buffers in order as if they were one.
+    //! the default sends them one at a time
+    virtual ssize_t sendv(const iovec *iov,
+            size_t iovcnt,
+            int flags=0,
+            optional_timeout timeout_ms = nullopt)
+        __attribute__((warn_unused_result))
+    {
+        ssize_t total = 0;
+        for (size_t i=0; i<iovcnt; ++i) {
+            if (iov[i].iov_len == 0) continue;
+            ssize_t nw = this->send(iov[i].iov_base, iov[i].iov_len, flags, timeout_ms);
+            if (nw < 0) return total ? total : nw;
+            total += nw;
+            if ((size_t)nw != iov[i].iov_len) break;
+        }
+        return total;
+    }
+
     ssize_t recvall(void *buf, size_t len, optional_timeout timeout_ms=nullopt) {
         size_t pos = 0;
         ssize_t left = len;
@@ -141,6 +207,12 @@ public:
     netsock(netsock &&other) = default;
     netsock &operator = (netsock &&other) = default;
 
+    //! register with this thread's epoll once for the life of the socket,
+    //! see netpersist. only for sockets always read and written until EAGAIN
+    void persist() {
+        netpersist(s.fd);
+    }
+
     //! dial requires a large 8MB stack size for getaddrinfo; throws on error
     void dial(const char *addr,
             uint16_t port,
@@ -178,14 +250,49 @@ public:
     {
         return netsend(s.fd, buf, len, flags, timeout_ms);
     }
+
+    ssize_t recvv(const iovec *iov,
+            size_t iovcnt,
+            int flags=0,
+            optional_timeout timeout_ms=nullopt) override
+        __attribute__((warn_unused_result))
+    {
+        return netrecvv(s.fd, iov, iovcnt, flags, timeout_ms);
+    }
+
+    ssize_t sendv(const iovec *iov,
+            size_t iovcnt,
+            int flags=0,
+            optional_timeout timeout_ms=nullopt) override
+        __attribute__((warn_unused_result))
+    {
+        return netsendv(s.fd, iov, iovcnt, flags, timeout_ms);
+    }
+};
+
+//! what netproxy moved each way, and the errno that ended each way,
+//! 0 when it ended with the other side closing
+struct netproxy_stats {
+    uint64_t a_to_b = 0;
+    uint64_t b_to_a = 0;
+    int a_to_b_error = 0;
+    int b_to_a_error = 0;
 };
 
+//! relay both ways between a and b with netsplice until both sides have
+//! closed, one direction in a new task and the other in this one. a close
+//! on one side is passed on as a half-close, so the other way keeps going.
+//! an error or timeout either way shuts down both sockets
+netproxy_stats netproxy(netsock &a, netsock &b, optional_timeout ms=nullopt);
+
 //! task/proc aware socket server
 class netsock_server : public std::enable_shared_from_this<netsock_server> {
 protected:
     netsock _sock;
     std::string _protocol_name;
     optional_timeout _recv_timeout_ms;
+    size_t _idle_tasks = 0;
+    bool _persist_sockets = false;
 public:
     netsock_server(const std::string &protocol_name_,
                    nostacksize_t=nostacksize,
@@ -249,6 +356,22 @@ public:
         return _sock.s.fd;
     }
 
+    //! keep up to n finished connection tasks per accept thread parked
+    //! for the next connections, see task_pool. pooled tasks are pinned
+    //! to the accept thread, so work stealing can't move them. the
+    //! default 0 spawns a task for every connection. call before serve
+    void set_idle_tasks(size_t n) {
+        _idle_tasks = n;
+    }
+
+    //! persist every client socket, see netsock::persist. only safe when
+    //! on_connection always reads until EAGAIN before waiting, as the
+    //! netsock calls do, and never waits with fdwait or taskpoll after
+    //! a partial read. call before serve
+    void set_persist_sockets(bool on) {
+        _persist_sockets = on;
+    }
+
 protected:
 
     virtual void setup_listen_socket(netsock &s) {
@@ -259,6 +382,7 @@ protected:
         using namespace std::chrono;
         const auto self = shared_from_this();
         auto bo = make_backoff(milliseconds{100}, milliseconds{500});
+        task_pool clients{_idle_tasks};
         for (;;) {
             address client_addr;
             int fd = _sock.accept(client_addr, 0);
@@ -288,7 +412,7 @@ protected:
             else {
                 bool nomem = false;
                 try {
-                    task::spawn([=] {
+                    clients.spawn([=] {
                         self->client_task(fd);
                     });
                 } catch (std::bad_alloc &e) {
@@ -313,6 +437,9 @@ protected:
     void client_task(int fd) {
         netsock s(fd);
         try {
+            if (_persist_sockets) {
+                s.persist();
+            }
             on_connection(s);
         } catch (std::exception &e) {
             LOG(ERROR) << "unhandled client task error: " << e.what();
@@ -71,6 +71,11 @@ public:
         return BIO_write(bio, buf, len);
     }
 
+    //! small buffers are joined so they go out in one tls record
+    ssize_t sendv(const iovec *iov,
+            size_t iovcnt, int flags=0, optional_timeout timeout_ms=nullopt) override
+        __attribute__((warn_unused_result));
+
     void handshake();
 
 };
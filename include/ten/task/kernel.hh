@@ -4,6 +4,7 @@
 #include "ten/ptr.hh"
 #include "ten/optional.hh"
 #include <chrono>
+#include <csignal>
 
 namespace ten {
 
@@ -13,6 +14,14 @@ public:
     using time_point = clock::time_point;
     using duration   = clock::duration;
 
+    //! event loop used for socket io
+    enum class io_backend {
+        //! wait for readiness with epoll, then make the syscall
+        epoll,
+        //! netrecv/netsend/netaccept/netconnect are submitted to io_uring
+        uring
+    };
+
     //! return cached time from event loop, not precise
     static time_point now();
 
@@ -25,9 +34,124 @@ public:
     //! perform setup
     static void boot();
 
+    //! io backend picked at boot, falls back to epoll without io_uring
+    static io_backend backend();
+
     //! wait for all tasks
     static void wait_for_tasks();
 
+    //! share tasks spawned in this thread with other work stealing threads
+    //! and steal their new tasks when idle. off by default.
+    //! tasks only move before they first run, see task::spawn_pinned
+    static void set_work_stealing(bool enable);
+
+    //! when this thread runs out of ready tasks, poll epoll and other
+    //! threads' wakeups without blocking for up to budget before going to
+    //! sleep. trades a cpu for wakeup latency. zero, the default, blocks
+    //! right away. sockets can also ask the kernel to busy poll the
+    //! device queue, see sockbase::set_busy_poll
+    static void set_busy_poll(duration budget);
+
+    //! each epoll_wait in this thread asks for a batch of events that
+    //! doubles when a wait fills it and halves when a wait returns less
+    //! than a quarter of it, staying between min_events and max_events.
+    //! defaults are 16 and 1024
+    static void set_io_batch(size_t min_events, size_t max_events);
+
+    //! while tasks are ready in this thread, poll for io without blocking
+    //! after running tasks of them, or after time has passed since the
+    //! last poll, so fresh io isn't stuck behind a long ready queue.
+    //! zero turns either limit off, both are off by default
+    static void set_run_budget(size_t tasks, duration time=duration::zero());
+
+    struct loop_counts {
+        //! times around the scheduler loop
+        uint64_t iterations;
+        //! epoll_wait calls, blocking or not
+        uint64_t waits;
+        //! events those calls returned
+        uint64_t events;
+        //! polls forced by the run budget
+        uint64_t budget_polls;
+        //! events asked for by the next epoll_wait
+        size_t batch;
+    };
+
+    //! counts for this thread's scheduler
+    static loop_counts loop_stats();
+
+    //! allocate stacks of the default size from one region reserved for
+    //! max_stacks of them, instead of a mapping per stack. stacks are
+    //! committed as they are touched and returned with MADV_DONTNEED.
+    //! hugepages asks for transparent huge pages on the region.
+    //! \return false if an arena is already in use or can't be reserved
+    static bool use_stack_arena(size_t max_stacks, bool hugepages=false);
+
+    //! stacks of finished tasks are cached per thread. a cache that grows
+    //! past high spills down to low into a depot shared by all threads,
+    //! and an empty cache takes up to low from it. the depot holds at most
+    //! depot_max stacks. defaults are 32, 128 and 1024
+    static void set_stack_cache_watermarks(size_t low, size_t high, size_t depot_max);
+
+    //! paint the stack of one in every one_in tasks, and when they exit
+    //! record how much was used in ten::metrics, 0 turns it off. counters
+    //! are stack.<name>.samples, stack.<name>.used for the sum of bytes,
+    //! and stack.<name>.fits.<class> for the smallest stack_class that
+    //! was big enough, and the gauge stack.<name>.max, the deepest use
+    //! seen, only ever rises. name is the task name up to the first '['
+    static void set_stack_sampling(uint32_t one_in);
+
+    struct stack_cache_counts {
+        //! stacks reused from a thread's cache
+        uint64_t hits;
+        //! stacks that had to be allocated
+        uint64_t misses;
+        //! stacks moved from the depot to a thread's cache
+        uint64_t refilled;
+        //! stacks moved from a thread's cache to the depot
+        uint64_t spilled;
+        //! stacks in the depot now
+        uint64_t depot_size;
+    };
+
+    //! threads publish their counts in batches and when they exit
+    static stack_cache_counts stack_cache_stats();
+
+    //! a task locking a qutex held by a task running on another thread
+    //! spins for up to max_spins pauses before parking, as long as no
+    //! other task on its own thread is ready. the limit used adapts to
+    //! how many spins recent contended locks needed. 0 always parks,
+    //! default is 200
+    static void set_qutex_spin(uint32_t max_spins);
+
+    struct qutex_counts {
+        //! contended locks taken by spinning
+        uint64_t spun;
+        //! contended locks that parked the task
+        uint64_t parked;
+    };
+
+    static qutex_counts qutex_stats();
+
+    //! time how long each task runs per switch and how long it waits in
+    //! the ready queue, and publish it to ten::metrics every 256 switches
+    //! and when the task exits. task.<name>.switches counts switches,
+    //! task.<name>.run and task.<name>.wait are timers, and
+    //! task.<name>.slices.<bucket> and task.<name>.waits.<bucket> count
+    //! slices and waits by length: lt_10us, lt_100us, lt_1ms, lt_10ms
+    //! and ge_10ms. name is the task name up to the first '['. off by
+    //! default, the first call to enable it blocks a few ms to calibrate
+    static void set_task_profiling(bool enable);
+
+    //! start a thread that looks for schedulers that have not switched
+    //! tasks in stall, and logs the name, state and backtrace of the task
+    //! running on them. stalls are counted in ten::metrics as
+    //! watchdog.stalls and watchdog.stalls.<name>, name being the task
+    //! name up to the first '['. the backtrace is taken by interrupting
+    //! the stalled thread with signo, give another signal if the program
+    //! uses SIGURG. zero stops the watchdog, which is the default
+    static void set_watchdog(duration stall, int signo=SIGURG);
+
     //! perform clean shutdown
     static void shutdown();
 
@@ -35,7 +159,7 @@ public:
     static int32_t is_computer_on();
     static double is_computer_on_fire();
 
-    kernel(optional<size_t> stacksize=nullopt);
+    kernel(optional<size_t> stacksize=nullopt, io_backend backend=io_backend::epoll);
     ~kernel(); 
 };
 
@@ -3,23 +3,36 @@
 
 #include "ten/task.hh"
 #include "ten/ptr.hh"
+#include "ten/task/wait_list.hh"
+#include <atomic>
 #include <mutex>
-#include <deque>
 
 namespace ten {
 
 //! task aware mutex
 class qutex {
+    friend class kernel;
 private:
     std::mutex _m;
-    std::deque<ptr<task::impl>> _waiting;
+    wait_list _waiting;
     ptr<task::impl> _owner;
+    //! _owner != nullptr, so spinners can watch it without taking _m
+    std::atomic<bool> _locked;
+    //! about how many spins recent contended locks took, guarded by _m
+    uint32_t _spin_hint;
 
-    void unlock_or_giveup(std::lock_guard<std::mutex> &lk) noexcept;
+    //! see kernel::set_qutex_spin
+    static std::atomic<uint32_t> max_spin;
+    //! see kernel::qutex_stats
+    static std::atomic<uint64_t> spun;
+    static std::atomic<uint64_t> parked;
+
+    void hand_off(std::lock_guard<std::mutex> &lk) noexcept;
+    bool spin(std::unique_lock<std::mutex> &lk, ptr<task::impl> t);
 public:
     enum lock_type_t { interruptable_lock, safe_lock };
 
-    qutex() : _owner(nullptr) {
+    qutex() : _owner(nullptr), _locked{false}, _spin_hint(0) {
         // a simple memory barrier would be sufficient here
         std::unique_lock<std::mutex> lk(_m);
     }
@@ -5,11 +5,36 @@
 
 namespace ten {
 
+class rendez;
+
+//! one of the conditions a task waits for in select_wait
+struct select_case {
+    virtual ~select_case() {}
+    //! lock protecting the condition
+    virtual qutex &lock() = 0;
+    //! woken when the condition might have become true
+    virtual rendez &waitq() = 0;
+    //! with lock held, perform the operation if it won't block
+    virtual bool try_complete() = 0;
+    //! with lock held, before and after waiting on waitq
+    virtual void parking() {}
+    virtual void unparking() {}
+};
+
+//! wait until one of the cases completes or when passes
+//! \return index of the completed case, nullopt on timeout
+optional<size_t> select_wait(select_case **cases, size_t ncases,
+        optional<kernel::time_point> when);
+
 //! task aware condition rendezvous point
 class rendez {
+    friend optional<size_t> select_wait(select_case **, size_t, optional<kernel::time_point>);
 private:
     std::mutex _m;
-    std::deque<ptr<task::impl>> _waiting;
+    wait_list _waiting;
+
+    void add_waiter(wait_node &n);
+    bool remove_waiter(wait_node &n);
 public:
     rendez() {}
     rendez(const rendez &) = delete;
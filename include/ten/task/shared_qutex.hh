@@ -0,0 +1,78 @@
+#ifndef LIBTEN_TASK_SHARED_QUTEX_HH
+#define LIBTEN_TASK_SHARED_QUTEX_HH
+
+#include "ten/task/qutex.hh"
+
+namespace ten {
+
+//! task aware reader/writer mutex
+//
+//! any number of tasks can hold it shared, or one task exclusively.
+//! writers are preferred: once a writer is waiting, new readers wait
+//! behind it. readers that queued while a writer held the lock all get
+//! it together when that writer unlocks, so neither side can starve.
+class shared_qutex {
+private:
+    std::mutex _m;
+    wait_list _writers;
+    wait_list _readers;
+    ptr<task::impl> _writer;
+    size_t _nreaders;
+
+    void wait(wait_node &w, qutex::lock_type_t lt, bool exclusive);
+    void release_exclusive();
+    void release_shared();
+    void grant_writer();
+    void grant_readers();
+public:
+    shared_qutex() : _writer(nullptr), _nreaders(0) {
+        // a simple memory barrier would be sufficient here
+        std::unique_lock<std::mutex> lk(_m);
+    }
+    shared_qutex(const shared_qutex &) = delete;
+    shared_qutex &operator =(const shared_qutex &) = delete;
+
+    ~shared_qutex() {}
+
+    void lock(qutex::lock_type_t lt = qutex::interruptable_lock);
+    void unlock();
+    bool try_lock();
+
+    void lock_shared(qutex::lock_type_t lt = qutex::interruptable_lock);
+    void unlock_shared();
+    bool try_lock_shared();
+};
+
+//! like std::unique_lock, but takes the lock shared
+template <typename Mutex>
+class shared_lock {
+    Mutex *_mut;
+    bool _owns;
+
+public:
+    explicit shared_lock(Mutex &mut) : _mut(&mut), _owns(false) {
+        lock();
+    }
+    ~shared_lock() {
+        if (_owns) _mut->unlock_shared();
+    }
+
+    shared_lock(const shared_lock &) = delete;
+    shared_lock & operator = (const shared_lock &) = delete;
+
+    void lock() {
+        _mut->lock_shared();
+        _owns = true;
+    }
+
+    void unlock() {
+        _owns = false;
+        _mut->unlock_shared();
+    }
+
+    bool owns_lock() const { return _owns; }
+};
+
+} // namespace
+
+#endif // LIBTEN_TASK_SHARED_QUTEX_HH
@@ -27,6 +27,29 @@ inline D timeval_duration(timeval tv) {
 //! dummy type to smooth API change
 enum nostacksize_t { nostacksize };
 
+//! stack size for a spawned task
+enum class stack_class {
+    //! the default stack size, 256KB unless given to task::main
+    normal,
+    //! 32KB, for tasks that don't recurse or keep big buffers on the stack
+    small,
+    //! 64KB
+    medium,
+    //! 1MB
+    large
+};
+
+//! which ready tasks a scheduler runs first, see this_task::set_priority
+enum class task_priority {
+    //! health checks, heartbeats and other work that must not queue
+    //! behind a backlog
+    critical,
+    //! the default
+    normal,
+    //! bulk work that can wait
+    background
+};
+
 namespace this_task {
 
 //! id of the current task
@@ -35,6 +58,17 @@ uint64_t get_id();
 //! allow other tasks to run
 void yield();
 
+//! set the priority of the current task
+//
+//! when a scheduler has ready tasks at several priorities it runs up
+//! to 16 critical, then 4 normal, then 1 background task in turn, so
+//! lower priorities are slowed down but never starved. takes effect the
+//! next time the task is made ready
+void set_priority(task_priority p);
+
+//! priority of the current task
+task_priority priority();
+
 //! sleep current task until time is reached
 void sleep_until(const kernel::time_point & sleep_time);
 
@@ -48,6 +82,7 @@ template <class Rep, class Period>
 
 //! cooperatively scheduled light-weight threads of execution
 class task {
+    friend class task_pool;
 public:
     class impl;
 
@@ -56,8 +91,9 @@ public:
 
     //! call from main() to setup task system and do boilerplate exception handling
     template <class Func>
-        static int main(Func &&f, optional<size_t> stacksize=nullopt) {
-            kernel the_kernel(stacksize);
+        static int main(Func &&f, optional<size_t> stacksize=nullopt,
+                kernel::io_backend backend=kernel::io_backend::epoll) {
+            kernel the_kernel(stacksize, backend);
             return introduce(std::forward<Func>(f));
         }
 
@@ -68,9 +104,16 @@ public:
     task &operator=(task &&) = default;
 
     //! spawn a new task in the current thread
+    //! with work stealing enabled it may be run by another thread
+    template<class Function> 
+        static task spawn(Function &&f, stack_class sc=stack_class::normal) {
+            return task{f, false, sc};
+        }
+
+    //! spawn a new task that always runs in the current thread
     template<class Function> 
-        static task spawn(Function &&f) {
-            return task{f};
+        static task spawn_pinned(Function &&f, stack_class sc=stack_class::normal) {
+            return task{f, true, sc};
         }
 
     //! spawn a new task in a new thread
@@ -97,7 +140,7 @@ public:
 private:
     std::shared_ptr<impl> _impl;
 
-    explicit task(std::function<void ()> f);
+    task(std::function<void ()> f, bool pinned, stack_class sc);
 
     //! task entry boilerplate exception handling
     static int entry(std::function<void ()> f);
@@ -0,0 +1,45 @@
+#ifndef LIBTEN_TASK_TASK_POOL_HH
+#define LIBTEN_TASK_TASK_POOL_HH
+
+#include "ten/task/task.hh"
+#include <vector>
+
+namespace ten {
+
+//! runs closures in tasks that are kept around between closures
+//
+//! a task that finishes a closure parks itself in the pool, up to
+//! max_idle of them, and the next spawn hands it a new closure instead
+//! of allocating a task, stack and context. closures run in order of
+//! spawn like task::spawn, and see the id of the task they run in.
+//! a closure that gets its task canceled ends that task.
+//! not thread safe, tasks stay in the thread that made the pool,
+//! except with max_idle 0, which is the same as task::spawn.
+//! parked tasks exit when the pool is destroyed or the thread shuts down.
+class task_pool {
+public:
+    explicit task_pool(size_t max_idle, stack_class sc=stack_class::normal);
+    ~task_pool();
+
+    task_pool(const task_pool &) = delete;
+    task_pool &operator = (const task_pool &) = delete;
+
+    //! run f in a parked task, or in a new one if none are parked
+    void spawn(std::function<void ()> f);
+
+    //! tasks parked now
+    size_t idle() const;
+    //! closures that needed a new task
+    uint64_t spawned() const;
+    //! closures that reused a parked task
+    uint64_t reused() const;
+
+    struct worker;
+    struct state;
+private:
+    std::shared_ptr<state> _state;
+};
+
+} // ten
+
+#endif // LIBTEN_TASK_TASK_POOL_HH
@@ -0,0 +1,88 @@
+#ifndef LIBTEN_TASK_WAIT_LIST_HH
+#define LIBTEN_TASK_WAIT_LIST_HH
+
+#include "ten/task.hh"
+#include "ten/ptr.hh"
+#include <cstddef>
+
+namespace ten {
+
+//! a task waiting in a wait_list
+//
+//! lives on the waiting task's stack, so waiting doesn't allocate.
+//! it must be unlinked before it goes out of scope.
+struct wait_node {
+    ptr<task::impl> t;
+    wait_node *prev;
+    wait_node *next;
+    bool linked;
+
+    explicit wait_node(ptr<task::impl> t_=nullptr)
+        : t(t_), prev(nullptr), next(nullptr), linked(false) {}
+
+    wait_node(const wait_node &) = delete;
+    wait_node &operator = (const wait_node &) = delete;
+};
+
+//! intrusive fifo of waiting tasks, O(1) push, pop and remove
+//
+//! not thread safe, the owner guards it with its own lock
+class wait_list {
+private:
+    wait_node *_head;
+    wait_node *_tail;
+    size_t _size;
+public:
+    wait_list() : _head(nullptr), _tail(nullptr), _size(0) {}
+
+    wait_list(const wait_list &) = delete;
+    wait_list &operator = (const wait_list &) = delete;
+
+    bool empty() const { return _head == nullptr; }
+    size_t size() const { return _size; }
+
+    wait_node *front() const { return _head; }
+
+    void push_back(wait_node &n) {
+        n.prev = _tail;
+        n.next = nullptr;
+        if (_tail) {
+            _tail->next = &n;
+        } else {
+            _head = &n;
+        }
+        _tail = &n;
+        n.linked = true;
+        ++_size;
+    }
+
+    //! nullptr if empty
+    wait_node *pop_front() {
+        wait_node *n = _head;
+        if (n) remove(*n);
+        return n;
+    }
+
+    //! false if n wasn't in a list
+    bool remove(wait_node &n) {
+        if (!n.linked) return false;
+        if (n.prev) {
+            n.prev->next = n.next;
+        } else {
+            _head = n.next;
+        }
+        if (n.next) {
+            n.next->prev = n.prev;
+        } else {
+            _tail = n.prev;
+        }
+        n.prev = n.next = nullptr;
+        n.linked = false;
+        --_size;
+        return true;
+    }
+};
+
+} // namespace
+
+#endif // LIBTEN_TASK_WAIT_LIST_HH
@@ -0,0 +1,146 @@
+#ifndef LIBTEN_WSDEQUE_HH
+#define LIBTEN_WSDEQUE_HH
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <type_traits>
+
+namespace ten {
+// work stealing deque
+// "Correct and Efficient Work-Stealing for Weak Memory Models"
+// by Le, Pop, Cohen and Zappa Nardelli (PPoPP 2013)
+// one owner thread pushes and pops at the bottom,
+// any number of thieves steal from the top.
+// T must be a scalar type, in practice a pointer.
+
+template <typename T, size_t CACHE_LINE_SIZE=64>
+struct wsdeque {
+    static_assert(std::is_scalar<T>::value, "wsdeque<T> requires a scalar T");
+private:
+    struct array {
+        const int64_t capacity;
+        const int64_t mask;
+        std::unique_ptr<std::atomic<T>[]> slots;
+
+        explicit array(int64_t cap)
+            : capacity(cap), mask(cap-1), slots(new std::atomic<T>[cap]) {}
+
+        T get(int64_t i) const {
+            return slots[i & mask].load(std::memory_order_relaxed);
+        }
+        void put(int64_t i, T v) {
+            slots[i & mask].store(v, std::memory_order_relaxed);
+        }
+        array *grow(int64_t bottom, int64_t top) const {
+            array *a = new array(capacity * 2);
+            for (int64_t i=top; i<bottom; ++i) {
+                a->put(i, get(i));
+            }
+            return a;
+        }
+    };
+private:
+    // shared among thieves
+    std::atomic<int64_t> _top;
+    char pad0[CACHE_LINE_SIZE - sizeof(std::atomic<int64_t>)];
+    // written by the owner only
+    std::atomic<int64_t> _bottom;
+    char pad1[CACHE_LINE_SIZE - sizeof(std::atomic<int64_t>)];
+    std::atomic<array *> _array;
+    // thieves might still be reading a grown array,
+    // so old arrays are only freed with the deque
+    std::vector<std::unique_ptr<array>> _retired;
+public:
+    explicit wsdeque(size_t capacity=256) : _top{0}, _bottom{0} {
+        size_t cap = 1;
+        while (cap < capacity) cap <<= 1;
+        _array.store(new array(cap), std::memory_order_relaxed);
+    }
+
+    wsdeque(const wsdeque &) = delete;
+    wsdeque &operator = (const wsdeque &) = delete;
+
+    ~wsdeque() {
+        delete _array.load(std::memory_order_relaxed);
+    }
+
+    //! owner only
+    void push(T v) {
+        int64_t b = _bottom.load(std::memory_order_relaxed);
+        int64_t t = _top.load(std::memory_order_acquire);
+        array *a = _array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) {
+            array *bigger = a->grow(b, t);
+            _retired.emplace_back(a);
+            _array.store(bigger, std::memory_order_release);
+            a = bigger;
+        }
+        a->put(b, v);
+        std::atomic_thread_fence(std::memory_order_release);
+        _bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    //! owner only, most recently pushed first
+    bool pop(T &result) {
+        int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+        array *a = _array.load(std::memory_order_relaxed);
+        _bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = _top.load(std::memory_order_relaxed);
+        if (t <= b) {
+            result = a->get(b);
+            if (t == b) {
+                // last item, race against thieves for it
+                bool won = _top.compare_exchange_strong(t, t + 1,
+                        std::memory_order_seq_cst, std::memory_order_relaxed);
+                _bottom.store(b + 1, std::memory_order_relaxed);
+                return won;
+            }
+            return true;
+        }
+        _bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    //! any thread, oldest pushed first
+    bool steal(T &result) {
+        int64_t t = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = _bottom.load(std::memory_order_acquire);
+        if (t < b) {
+            array *a = _array.load(std::memory_order_consume);
+            T v = a->get(t);
+            if (_top.compare_exchange_strong(t, t + 1,
+                        std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                result = v;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //! owner only, calls f with each item not yet popped, oldest first.
+    //! thieves can still steal an item while or after f sees it
+    template <typename F>
+    void for_each(F f) const {
+        const int64_t b = _bottom.load(std::memory_order_relaxed);
+        const array *a = _array.load(std::memory_order_relaxed);
+        for (int64_t i=_top.load(std::memory_order_acquire); i<b; ++i) {
+            f(a->get(i));
+        }
+    }
+
+    //! approximate when called concurrently with push/pop/steal
+    size_t size() const {
+        int64_t b = _bottom.load(std::memory_order_relaxed);
+        int64_t t = _top.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+};
+
+} // ten
+#endif
@@ -4,100 +4,192 @@
 #include <chrono>
 #include <vector>
 #include <algorithm>
+#include <utility>
+#include <exception>
 #include "ten/optional.hh"
 #include "ten/ptr.hh"
 
 namespace ten {
 
+//! pending alarms kept in a 4-ary min heap
+//
+//! alarms live in a slab of nodes that know their position in the heap,
+//! so cancel doesn't need to search. arming is O(log n), but timeouts
+//! are almost always armed in increasing order so sift up stops right away.
 template <class T, class Clock>
 struct alarm_clock {
     typedef typename Clock::time_point time_point;
     typedef typename Clock::duration   duration;
 
 private:
-    struct data {
-        T value;
+    typedef uint32_t index_type;
+    static constexpr index_type npos = index_type(-1);
+    static constexpr size_t arity = 4;
+
+    struct node {
+        T value{};
         time_point when;
         std::exception_ptr exception;
+        //! breaks ties so alarms for the same time fire in arming order
+        uint64_t seq = 0;
+        //! bumped every time the node is freed so stale handles can't cancel
+        uint32_t gen = 0;
+        //! position in _heap, or next free node when not armed
+        index_type pos = npos;
+    };
 
-        bool operator == (const data &other) {
-            if (value == other.value
-                    && when == other.when
-                    && exception == other.exception)
-            {
-                return true;
-            }
-            return false;
-        }
+    //! stable storage for alarms, indexed by handle
+    std::vector<node> _nodes;
+    //! head of the free list threaded through node::pos
+    index_type _free = npos;
+    //! node indexes ordered by when
+    std::vector<index_type> _heap;
+    uint64_t _seq = 0;
+    //! reused by tick to call back after the heap is consistent again
+    std::vector<std::pair<T, std::exception_ptr>> _fired;
+
+    struct handle {
+        index_type id;
+        uint32_t gen;
+
+        handle(index_type id_=npos, uint32_t gen_=0) : id(id_), gen(gen_) {}
     };
 
-    typedef std::vector<data> container_type;
-    container_type _set;
+    bool before(index_type a, index_type b) const {
+        const node &na = _nodes[a];
+        const node &nb = _nodes[b];
+        if (na.when != nb.when) return na.when < nb.when;
+        return na.seq < nb.seq;
+    }
 
-    struct order {
-        bool operator ()(const data &a, const data &b) const {
-            return a.when < b.when;
+    void place(size_t pos, index_type id) {
+        _heap[pos] = id;
+        _nodes[id].pos = pos;
+    }
+
+    void sift_up(size_t pos) {
+        const index_type id = _heap[pos];
+        while (pos > 0) {
+            const size_t parent = (pos - 1) / arity;
+            if (!before(id, _heap[parent])) break;
+            place(pos, _heap[parent]);
+            pos = parent;
         }
-    };
+        place(pos, id);
+    }
 
-    data insert(const T &t, const time_point &when) {
-        data d{t, when};
-        auto i = std::lower_bound(std::begin(_set),
-                std::end(_set), d, order());
-        _set.insert(i, d);
-        return d;
+    void sift_down(size_t pos) {
+        const index_type id = _heap[pos];
+        const size_t n = _heap.size();
+        for (;;) {
+            const size_t first = pos * arity + 1;
+            if (first >= n) break;
+            const size_t last = std::min(first + arity, n);
+            size_t best = first;
+            for (size_t c = first + 1; c < last; ++c) {
+                if (before(_heap[c], _heap[best])) best = c;
+            }
+            if (!before(_heap[best], id)) break;
+            place(pos, _heap[best]);
+            pos = best;
+        }
+        place(pos, id);
     }
 
-    template<typename Exception>
-    data insert(const T &t, const time_point &when, Exception e) {
-        data d{t, when, std::make_exception_ptr(e)};
-        auto i = std::lower_bound(std::begin(_set),
-                std::end(_set), d, order());
-        _set.insert(i, d);
-        return d;
+    index_type alloc_node() {
+        if (_free != npos) {
+            const index_type id = _free;
+            _free = _nodes[id].pos;
+            return id;
+        }
+        _nodes.emplace_back();
+        return _nodes.size() - 1;
+    }
+
+    void free_node(index_type id) {
+        node &n = _nodes[id];
+        n.value = T{};
+        n.exception = nullptr;
+        ++n.gen;
+        n.pos = _free;
+        _free = id;
     }
 
-    void remove(const data &d) {
-        auto i = find(begin(_set), end(_set), d);
-        if (i != end(_set)) {
-            _set.erase(i);
+    //! take node out of the heap, leaving it allocated
+    void unlink(index_type id) {
+        const size_t pos = _nodes[id].pos;
+        const index_type last = _heap.back();
+        _heap.pop_back();
+        if (last != id) {
+            place(pos, last);
+            if (pos > 0 && before(last, _heap[(pos - 1) / arity])) {
+                sift_up(pos);
+            } else {
+                sift_down(pos);
+            }
         }
     }
 
-    void remove(const T &value) {
-        auto i = remove_if(begin(_set), end(_set),
-                [&value](const data &d) { return d.value == value; });
-        _set.erase(i, end(_set));
+    handle insert(const T &t, const time_point &when, std::exception_ptr e=nullptr) {
+        const index_type id = alloc_node();
+        node &n = _nodes[id];
+        n.value = t;
+        n.when = when;
+        n.exception = std::move(e);
+        n.seq = _seq++;
+        _heap.push_back(id);
+        sift_up(_heap.size() - 1);
+        return handle{id, n.gen};
+    }
+
+    template<typename Exception>
+    handle insert(const T &t, const time_point &when, Exception e) {
+        return insert(t, when, std::make_exception_ptr(e));
+    }
+
+    void remove(const handle &h) {
+        // the alarm might have already fired and the node been reused
+        if (h.id < _nodes.size() && _nodes[h.id].gen == h.gen) {
+            unlink(h.id);
+            free_node(h.id);
+        }
     }
 
 public:
     template <class Function>
     void tick(const time_point &now, Function f) {
-        auto i = begin(_set);
-        for (; i != end(_set); ++i) {
-            if (i->when <= now) {
-                f(i->value, i->exception);
-            } else {
-                break;
-            }
+        // pop everything that expired first so callbacks
+        // can safely arm and cancel other alarms
+        while (!_heap.empty() && _nodes[_heap.front()].when <= now) {
+            const index_type id = _heap.front();
+            node &n = _nodes[id];
+            _fired.emplace_back(std::move(n.value), std::move(n.exception));
+            unlink(id);
+            free_node(id);
+        }
+        for (auto &fired : _fired) {
+            f(fired.first, fired.second);
         }
-        _set.erase(begin(_set), i);
+        _fired.clear();
     }
 
-    bool empty() const { return _set.empty(); }
+    bool empty() const { return _heap.empty(); }
+
+    size_t size() const { return _heap.size(); }
 
     optional<time_point> when() const {
-        if (_set.empty()) {
+        if (_heap.empty()) {
             return nullopt;
         }
-        return _set.front().when;
+        return _nodes[_heap.front()].when;
     }
 
 public:
     struct scoped_alarm {
 
         ptr<alarm_clock<T, Clock>> _set;
-        typename alarm_clock<T, Clock>::data _data;
+        typename alarm_clock<T, Clock>::handle _handle;
+        time_point _when;
         bool _armed = false;
 
         scoped_alarm() {}
@@ -107,36 +199,38 @@ public:
 
         scoped_alarm(scoped_alarm &&other) : _set{other._set} {
             other._set.reset();
-            std::swap(_data, other._data);
+            std::swap(_handle, other._handle);
+            std::swap(_when, other._when);
             std::swap(_armed, other._armed);
         }
 
         scoped_alarm &operator = (scoped_alarm &&other) {
             if (this != &other) {
                 std::swap(_set, other._set);
-                std::swap(_data, other._data);
+                std::swap(_handle, other._handle);
+                std::swap(_when, other._when);
                 std::swap(_armed, other._armed);
             }
             return *this;
         }
 
         scoped_alarm(alarm_clock<T, Clock> &s, const T &value, time_point when)
-            : _set(&s), _armed(true)
+            : _set(&s), _when(when), _armed(true)
         {
-            _data = _set->insert(value, when);
+            _handle = _set->insert(value, when);
         }
 
         template <class Exception>
             scoped_alarm(alarm_clock<T, Clock> &s, const T &value, time_point when, Exception e)
-            : _set(&s), _armed(true)
+            : _set(&s), _when(when), _armed(true)
             {
-                _data = _set->insert(value, when, e);
+                _handle = _set->insert(value, when, e);
             }
 
         duration remaining() const {
             if (_armed) {
                 const time_point now = Clock::now();
-                const duration rem = _data.when - now;
+                const duration rem = _when - now;
                 if (rem > duration::zero())
                     return rem;
             }
@@ -146,7 +240,7 @@ public:
         void cancel() {
             if (_armed) {
                 _armed = false;
-                _set->remove(_data);
+                _set->remove(_handle);
             }
         }
 
@@ -4,6 +4,7 @@
 #include "stack_alloc.hh"
 #include <boost/context/fcontext.hpp>
 #include <boost/context/stack_utils.hpp>
+#include <algorithm>
 
 #ifndef NVALGRIND
 #include <valgrind/valgrind.h>
@@ -12,11 +13,22 @@
 namespace ten {
 
 class context {
+    static constexpr uint64_t canary = 0xfee1deadfee1deadULL;
+
     boost::ctx::fcontext_t _ctx;
 #ifndef NVALGRIND
     //! stack id so valgrind doesn't freak when stack swapping happens
     int valgrind_stack_id;
 #endif
+
+    // skip the guard page at the bottom
+    uint64_t *paint_begin() const {
+        return reinterpret_cast<uint64_t *>(
+                static_cast<char *>(_ctx.fc_stack.limit) + stack_allocator::page_size);
+    }
+    uint64_t *paint_end() const {
+        return static_cast<uint64_t *>(_ctx.fc_stack.base);
+    }
 public:
     typedef void (*func_type)(intptr_t);
 public:
@@ -27,7 +39,10 @@ public:
     context() noexcept {}
 
     //! make a new context and stack
-    explicit context(func_type f, size_t stack_size = boost::ctx::default_stacksize()) {
+    //! \param paint fill the stack so stack_used can measure it later
+    explicit context(func_type f, size_t stack_size = boost::ctx::default_stacksize(),
+            bool paint = false)
+    {
         memset(&_ctx, 0, sizeof(_ctx));
         void *stack = stack_allocator::allocate(stack_size);
 #ifndef NVALGRIND
@@ -36,6 +51,9 @@ public:
 #endif
         _ctx.fc_stack.base = stack;
         _ctx.fc_stack.limit = reinterpret_cast<void *>(reinterpret_cast<intptr_t>(stack)-stack_size);
+        if (paint) {
+            std::fill(paint_begin(), paint_end(), canary);
+        }
         boost::ctx::make_fcontext(&_ctx, f);
     }
 
@@ -50,6 +68,15 @@ public:
             reinterpret_cast<intptr_t>(_ctx.fc_stack.limit);
     }
 
+    //! deepest the stack has been, only meaningful if it was painted
+    size_t stack_used() const {
+        // the stack grows down, so the first word that changed is the deepest
+        const uint64_t *p = std::find_if(paint_begin(), paint_end(),
+                [](uint64_t w) { return w != canary; });
+        return reinterpret_cast<intptr_t>(_ctx.fc_stack.base) -
+            reinterpret_cast<intptr_t>(p);
+    }
+
     ~context() {
         if (_ctx.fc_stack.base) {
             void *stack = _ctx.fc_stack.base;
@@ -67,7 +67,11 @@ namespace hs {
         Content_Encoding{"Content-Encoding"},
             identity{"identity"},
         Cache_Control{"Cache-Control"},
-            no_cache{"no-cache"};
+            no_cache{"no-cache"},
+        Range{"Range"},
+        Content_Range{"Content-Range"},
+        Accept_Ranges{"Accept-Ranges"},
+            bytes{"bytes"};
 }
 
 const std::string &version_string(http_version ver) {
@@ -341,7 +345,11 @@ static int _response_on_headers_complete(http_parser *p) {
 void http_response::parser_init(struct http_parser *p) {
     http_parser_init(p, HTTP_RESPONSE);
     p->data = this;
+    // a response to HEAD has no body whatever its Content-Length says,
+    // which only the request knows, so keep that across the clear
+    const bool head_only = guillotine;
     clear();
+    guillotine = head_only;
 }
 
 void http_response::parse(struct http_parser *p, const char *data_, size_t &len) {
@@ -371,6 +379,38 @@ const std::string &http_response::reason() const {
     return unknown;
 }
 
+void http_response::set_file_body(std::shared_ptr<fd_base> fd,
+        off_t offset, optional<size_t> length, optional<std::string> content_type)
+{
+    struct stat st;
+    throw_if(::fstat(fd->fd, &st) == -1);
+    file_range f;
+    f.seekable = S_ISREG(st.st_mode);
+    if (f.seekable) {
+        f.size = st.st_size;
+        if ((size_t)offset > f.size) {
+            throw errorx("file body offset %jd past the end of the file", (intmax_t)offset);
+        }
+        f.length = length ? std::min(*length, f.size - offset) : f.size - offset;
+    } else {
+        if (!length) {
+            throw errorx("file body needs a length unless it is a regular file");
+        }
+        f.length = *length;
+        f.size = f.length;
+    }
+    f.fd = std::move(fd);
+    f.offset = offset;
+    body.clear();
+    body_length = f.length;
+    set(hs::Content_Length, f.length);
+    if (content_type)
+        set(hs::Content_Type, *content_type);
+    else if (!contains(hs::Content_Type))
+        set(hs::Content_Type, hs::app_octet_stream);
+    file_body = std::move(f);
+}
+
 std::string http_response::data() const {
     std::ostringstream ss;
     ss << version_string(version) << " " << status_code << " " << reason() << "\r\n";
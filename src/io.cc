@@ -1,5 +1,8 @@
 #include "io.hh"
 #include "thread_context.hh"
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
 
 namespace ten {
 
@@ -7,8 +10,32 @@ namespace ten {
 extern inotify_fd resolv_conf_watch_fd;
 #endif // HAS_CARES
 
+namespace {
+    // user_data for completions that don't belong to a task
+    // uring_op pointers are aligned so can't collide with these
+    constexpr uint64_t ignore_tag = 0;
+    constexpr uint64_t efd_poll_tag = 1;
+    constexpr unsigned uring_entries = 256;
+
+    // the io that persisted each fd, so closing it in any thread drops
+    // the registration before the fd number can be reused
+    std::mutex persisted_mutex;
+    std::unordered_map<int, io *> persisted;
+    // closing only takes the lock while something is persisted
+    std::atomic<size_t> npersisted{0};
+    __thread io *this_io = nullptr;
+}
+
+void fd_closing(int fd) noexcept {
+    io::closing(fd);
+}
+
 io::io() {
-    _events.reserve(100);
+    this_io = this;
+    _events.reserve(_batch);
+    if (kernel::backend() == kernel::io_backend::uring) {
+        _uring.reset(new uring{uring_entries});
+    }
     // add the eventfd used to wake up
     {
         epoll_event ev{};
@@ -39,7 +66,26 @@ io::io() {
 #endif // HAS_CARES
 }
 
-void io::add_pollfds(ptr<task::impl> t, pollfd *fds, nfds_t nfds) {
+io::~io() {
+    // always locked, even with nothing persisted, so a closing() in
+    // another thread that found this io is done with it before it goes
+    std::lock_guard<std::mutex> lock(persisted_mutex);
+    for (auto i = persisted.begin(); i != persisted.end(); ) {
+        if (i->second == this) {
+            i = persisted.erase(i);
+            --npersisted;
+        } else {
+            ++i;
+        }
+    }
+    this_io = nullptr;
+}
+
+int io::add_pollfds(ptr<task::impl> t, pollfd *fds, nfds_t nfds) {
+    if (_has_closed_fds.load(std::memory_order_acquire)) {
+        drop_closed_fds();
+    }
+    int ready_fds = 0;
     for (nfds_t i=0; i<nfds; ++i) {
         epoll_event ev{};
         int fd = fds[i].fd;
@@ -53,6 +99,19 @@ void io::add_pollfds(ptr<task::impl> t, pollfd *fds, nfds_t nfds) {
 
         _pollfds[fd].tasks.emplace_back(t, &fds[i]);
         _pollfds[fd].events |= fds[i].events;
+        ++_npollfds;
+
+        if (_pollfds[fd].persistent) {
+            // edge triggered won't report these again, so hand them out now.
+            // errors and hangups stay until the fd is forgotten
+            const uint32_t ready = _pollfds[fd].ready & (fds[i].events | EPOLLERR | EPOLLHUP);
+            if (ready) {
+                fds[i].revents = ready;
+                _pollfds[fd].ready &= ~(ready & ~(EPOLLERR | EPOLLHUP));
+                ++ready_fds;
+            }
+            continue;
+        }
 
         ev.events = _pollfds[fd].events | EPOLLONESHOT;
 
@@ -66,8 +125,8 @@ void io::add_pollfds(ptr<task::impl> t, pollfd *fds, nfds_t nfds) {
         } else if (saved_events != _pollfds[fd].events) {
             throw_if(_efd.modify(fd, ev) == -1);
         }
-        ++_npollfds;
     }
+    return ready_fds;
 }
 
 int io::remove_pollfds(pollfd *fds, nfds_t nfds) {
@@ -90,7 +149,7 @@ int io::remove_pollfds(pollfd *fds, nfds_t nfds) {
 
         if (fds[i].revents) {
             ++evented_fds;
-        } else {
+        } else if (!_pollfds[fd].persistent) {
             if (_pollfds[fd].events == 0) {
                 _efd.remove(fd);
             } else if (saved_events != _pollfds[fd].events) {
@@ -136,16 +195,18 @@ int io::poll(pollfd *fds, nfds_t nfds, optional_timeout ms) {
     } else {
         taskstate("poll %u fds for %ul ms", nfds, ms ? ms->count() : 0);
     }
-    add_pollfds(t, fds, nfds);
+    const int ready_fds = add_pollfds(t, fds, nfds);
 
     DVLOG(5) << "task: " << t << " poll for " << nfds << " fds";
     try {
-        optional<scheduler::alarm_clock::scoped_alarm> timeout_alarm;
-        if (ms) {
-            auto now = kernel::now();
-            timeout_alarm.emplace(this_ctx->scheduler.arm_alarm(t, now+*ms));
+        if (ready_fds == 0) {
+            optional<scheduler::alarm_clock::scoped_alarm> timeout_alarm;
+            if (ms) {
+                auto now = kernel::now();
+                timeout_alarm.emplace(this_ctx->scheduler.arm_alarm(t, now+*ms));
+            }
+            t->swap();
         }
-        t->swap();
     } catch (...) {
         remove_pollfds(fds, nfds);
         throw;
@@ -154,37 +215,182 @@ int io::poll(pollfd *fds, nfds_t nfds, optional_timeout ms) {
     return remove_pollfds(fds, nfds);
 }
 
+void io::persist(int fd) {
+    if (_has_closed_fds.load(std::memory_order_acquire)) {
+        drop_closed_fds();
+    }
+    if (_pollfds.size() <= (size_t)fd) {
+        _pollfds.resize(fd+1);
+    }
+    fd_poll_state &state = _pollfds[fd];
+    DCHECK(state.tasks.empty()) << "persist fd " << fd << " while tasks wait on it";
+    {
+        std::lock_guard<std::mutex> lock(persisted_mutex);
+        io *&owner = persisted[fd];
+        if (owner == nullptr) {
+            ++npersisted;
+        } else if (owner != this) {
+            // the number was closed without fd_closing and reused
+            std::lock_guard<std::mutex> closed_lock(owner->_closed_mutex);
+            owner->_closed_fds.push_back(fd);
+            owner->_has_closed_fds.store(true, std::memory_order_release);
+        }
+        owner = this;
+    }
+    // always (re)register, state.persistent might be left from an
+    // earlier fd with this number, or it might still be oneshot
+    epoll_event ev{};
+    ev.data.fd = fd;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    int status = _efd.modify(fd, ev);
+    if (status == -1 && errno == ENOENT) {
+        throw_if(_efd.add(fd, ev) == -1);
+    } else {
+        throw_if(status == -1);
+    }
+    state.persistent = true;
+    state.events = 0;
+    // registering reports whatever is already ready on the next epoll_wait
+    state.ready = 0;
+}
+
+void io::forget(int fd) {
+    if (_pollfds.size() <= (size_t)fd || !_pollfds[fd].persistent) return;
+    {
+        std::lock_guard<std::mutex> lock(persisted_mutex);
+        auto i = persisted.find(fd);
+        if (i != persisted.end() && i->second == this) {
+            persisted.erase(i);
+            --npersisted;
+        }
+    }
+    drop(fd, true);
+}
+
+void io::drop(int fd, bool unregister) {
+    if (_pollfds.size() <= (size_t)fd || !_pollfds[fd].persistent) return;
+    fd_poll_state &state = _pollfds[fd];
+    DCHECK(state.tasks.empty()) << "forget fd " << fd << " while tasks wait on it";
+    state.persistent = false;
+    state.events = 0;
+    state.ready = 0;
+    // forked children might share the file, then closing won't remove it
+    if (unregister) {
+        _efd.remove(fd);
+    }
+}
+
+void io::drop_closed_fds() {
+    std::vector<int> fds;
+    {
+        std::lock_guard<std::mutex> lock(_closed_mutex);
+        fds.swap(_closed_fds);
+        _has_closed_fds.store(false, std::memory_order_relaxed);
+    }
+    // closed by now, so the number may belong to a new file
+    // that mustn't be unregistered
+    for (int fd : fds) {
+        drop(fd, false);
+    }
+}
+
+void io::closing(int fd) noexcept {
+    if (fd < 0 || npersisted.load(std::memory_order_acquire) == 0) return;
+    io *owner = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(persisted_mutex);
+        auto i = persisted.find(fd);
+        if (i == persisted.end()) return;
+        owner = i->second;
+        persisted.erase(i);
+        --npersisted;
+        if (owner != this_io) {
+            // under persisted_mutex, which ~io takes, so owner is alive
+            std::lock_guard<std::mutex> closed_lock(owner->_closed_mutex);
+            owner->_closed_fds.push_back(fd);
+            owner->_has_closed_fds.store(true, std::memory_order_release);
+            return;
+        }
+    }
+    // callers might look at errno from close, not epoll_ctl
+    const int e = errno;
+    owner->drop(fd, true);
+    errno = e;
+}
+
+void io::set_batch(size_t min_events, size_t max_events) {
+    CHECK(min_events > 0 && min_events <= max_events);
+    _min_batch = min_events;
+    _max_batch = max_events;
+    _batch = std::min(std::max(_batch, _min_batch), _max_batch);
+}
+
 void io::wakeup() {
     _evfd.write(1);
 }
 
+void io::arm_timer(kernel::time_point when) {
+    if (_tfd_armed && *_tfd_armed == when) return;
+    // steady_clock is CLOCK_MONOTONIC, the timerfd's clock
+    using namespace std::chrono;
+    const auto ns = duration_cast<nanoseconds>(when.time_since_epoch()).count();
+    struct itimerspec tspec{};
+    tspec.it_value.tv_sec = ns / 1000000000;
+    tspec.it_value.tv_nsec = ns % 1000000000;
+    _tfd.settime(tspec, TFD_TIMER_ABSTIME);
+    _tfd_armed = when;
+}
+
 void io::wait(optional<kernel::time_point> when) {
-    // only process 100 events each iteration to keep it fair
-    _events.resize(100);
     int ms = -1;
     if (when) {
-        using namespace std::chrono;
         auto now = kernel::now();
         if (*when > now) {
-            // TODO: allow more than millisecond resolution?
-            ms = duration_cast<milliseconds>((*when - now) + microseconds(999)).count();
-            if (ms) {
-                struct itimerspec tspec{};
-                tspec.it_value.tv_sec = ms / 1000;
-                tspec.it_value.tv_nsec = (ms % 1000) * 1000000;
-                _tfd.settime(tspec);
-                // we use timer_fd to break from epoll_wait
-                // because its timeout isn't very accurate
-                ms = -1;
-            }
+            // we use timer_fd to break from epoll_wait because its
+            // timeout is only milliseconds and isn't very accurate.
+            // armed with the absolute time, so it stays right while
+            // the earliest alarm doesn't change
+            arm_timer(*when);
         } else {
             // don't wait at all
             ms = 0;
         }
     }
 
+    if (_uring) {
+        // the epoll fd is polled through the ring so one
+        // io_uring_enter submits, waits and wakes up for both
+        if (!_efd_polled) {
+            io_uring_sqe *sqe = _uring->get_sqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = _efd.fd;
+            sqe->poll_events = POLLIN;
+            sqe->user_data = efd_poll_tag;
+            _efd_polled = true;
+        }
+        _uring->submit(ms == 0 ? 0 : 1);
+        _submit_countdown = -1;
+        if (reap()) {
+            dispatch_events(0);
+        }
+        return;
+    }
+    dispatch_events(ms);
+}
+
+void io::dispatch_events(int ms) {
+    // only process a batch of events each iteration to keep it fair
+    _events.resize(_batch);
     _efd.wait(_events, ms);
-    ptr<task::impl> t;
+    ++_waits;
+    _nevents += _events.size();
+    if (_events.size() == _batch) {
+        // more are probably waiting, take them in fewer calls
+        _batch = std::min(_batch * 2, _max_batch);
+    } else if (_events.size() < _batch / 4) {
+        // smaller batches let the tasks behind them run sooner
+        _batch = std::max(_batch / 2, _min_batch);
+    }
     for (auto &event : _events) {
         // NOTE: epoll will also return EPOLLERR and EPOLLHUP for every fd
         // even if they arent asked for, so we must wake up the tasks on any event
@@ -196,6 +402,7 @@ void io::wait(optional<kernel::time_point> when) {
             _evfd.read();
         } else if (fd == _tfd.fd) {
             // timerfd fired for sleeping/timeout tasks
+            _tfd_armed = nullopt;
 #ifdef HAS_CARES
         } else if (fd == resolv_conf_watch_fd.fd) {
             inotify_event event;
@@ -206,17 +413,23 @@ void io::wait(optional<kernel::time_point> when) {
             this_ctx->dns_channel.reset();
 #endif // HAS_CARES
         } else if ((size_t)fd < _pollfds.size()) {
-            for (auto &st : _pollfds[fd].tasks) {
+            auto &state = _pollfds[fd];
+            uint32_t delivered = 0;
+            for (auto &st : state.tasks) {
                 if ((st.pfd->events & event.events) ||
                         event.events & (EPOLLERR | EPOLLHUP))
                 {
                     st.pfd->revents = event.events;
+                    delivered |= st.pfd->events & event.events;
                     DVLOG(5) << "fd " << fd << " EVENTS: " << event.events << " on task: " << st.t;
                     st.t->ready_for_io();
                 }
             }
 
-            if (_pollfds[fd].tasks.empty()) {
+            if (state.persistent) {
+                // remember what nobody was waiting for, the edge won't repeat
+                state.ready |= event.events & ~delivered;
+            } else if (state.tasks.empty()) {
                 // TODO: otherwise we might want to remove fd from epoll
                 LOG(ERROR) << "event " << event.events << " for fd: "
                     << event.data.fd << " but has no task";
@@ -227,6 +440,132 @@ void io::wait(optional<kernel::time_point> when) {
     }
 }
 
+bool io::reap() {
+    bool efd_ready = false;
+    _uring->reap([&](uint64_t user_data, int res) {
+        if (user_data == efd_poll_tag) {
+            _efd_polled = false;
+            efd_ready = true;
+        } else if (user_data != ignore_tag) {
+            uring_op *op = reinterpret_cast<uring_op *>(user_data);
+            op->res = res;
+            op->done = true;
+            op->t->ready_for_io();
+        }
+    });
+    return efd_ready;
+}
+
+void io::check_completions(size_t nready) {
+    if (!_uring) return;
+    if (_uring->pending() && nready > 0) {
+        // let the tasks that are already ready run and queue their
+        // own ops first, so one pass over the ready queue is one submit.
+        // with nothing ready wait() submits and waits in one go
+        if (_submit_countdown > nready) {
+            _submit_countdown = nready;
+        } else if (--_submit_countdown == 0) {
+            _uring->submit();
+            _submit_countdown = -1;
+        }
+    }
+    if (reap()) {
+        dispatch_events(0);
+    }
+}
+
+io_uring_sqe *io::prep(uint8_t opcode, int fd, uring_op &op) {
+    io_uring_sqe *sqe = _uring->get_sqe();
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = reinterpret_cast<uint64_t>(&op);
+    return sqe;
+}
 
+int io::complete(uring_op &op, optional_timeout ms) {
+    std::exception_ptr interrupted;
+    bool timed_out = false;
+    try {
+        optional<scheduler::alarm_clock::scoped_alarm> timeout_alarm;
+        if (ms) {
+            auto now = kernel::now();
+            timeout_alarm.emplace(this_ctx->scheduler.arm_alarm(op.t, now+*ms));
+        }
+        while (!op.done) {
+            op.t->swap();
+            if (timeout_alarm && timeout_alarm->remaining() == kernel::duration::zero()) {
+                timed_out = true;
+                break;
+            }
+        }
+    } catch (...) {
+        interrupted = std::current_exception();
+    }
+    if (!op.done) {
+        // the kernel may still write to the caller's buffer,
+        // so the op has to finish even if we were interrupted
+        io_uring_sqe *sqe = _uring->get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = reinterpret_cast<uint64_t>(&op);
+        sqe->user_data = ignore_tag;
+        while (!op.done) {
+            op.t->safe_swap();
+        }
+    }
+    if (interrupted) {
+        std::rethrow_exception(interrupted);
+    }
+    if (op.res < 0) {
+        // canceled io can end in ECANCELED, or EINTR when io-wq had it
+        // blocking, which callers would retry, so go by why we canceled
+        errno = timed_out ? ETIMEDOUT : -op.res;
+        return -1;
+    }
+    return op.res;
+}
+
+ssize_t io::recv(int fd, void *buf, size_t len, int flags, optional_timeout ms) {
+    const auto t = scheduler::current_task();
+    taskstate("recv fd %i %zu bytes", fd, len);
+    uring_op op{t};
+    io_uring_sqe *sqe = prep(IORING_OP_RECV, fd, op);
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    // a short read or write, like the syscall would do for a huge len
+    sqe->len = std::min<size_t>(len, UINT32_MAX);
+    sqe->msg_flags = flags;
+    return complete(op, ms);
+}
+
+ssize_t io::send(int fd, const void *buf, size_t len, int flags, optional_timeout ms) {
+    const auto t = scheduler::current_task();
+    taskstate("send fd %i %zu bytes", fd, len);
+    uring_op op{t};
+    io_uring_sqe *sqe = prep(IORING_OP_SEND, fd, op);
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = std::min<size_t>(len, UINT32_MAX);
+    sqe->msg_flags = flags;
+    return complete(op, ms);
+}
+
+int io::accept(int fd, sockaddr *addr, socklen_t *addrlen, int flags, optional_timeout ms) {
+    const auto t = scheduler::current_task();
+    taskstate("accept fd %i", fd);
+    uring_op op{t};
+    io_uring_sqe *sqe = prep(IORING_OP_ACCEPT, fd, op);
+    sqe->addr = reinterpret_cast<uint64_t>(addr);
+    sqe->addr2 = reinterpret_cast<uint64_t>(addrlen);
+    sqe->accept_flags = flags;
+    return complete(op, ms);
+}
+
+int io::connect(int fd, const sockaddr *addr, socklen_t addrlen, optional_timeout ms) {
+    const auto t = scheduler::current_task();
+    taskstate("connect fd %i", fd);
+    uring_op op{t};
+    io_uring_sqe *sqe = prep(IORING_OP_CONNECT, fd, op);
+    sqe->addr = reinterpret_cast<uint64_t>(addr);
+    sqe->off = addrlen;
+    return complete(op, ms);
+}
 
 } // ten
@@ -2,7 +2,9 @@
 #define LIBTEN_IO_HH
 
 #include "task_impl.hh"
+#include "uring.hh"
 #include "ten/descriptors.hh"
+#include <mutex>
 
 namespace ten {
 
@@ -19,6 +21,19 @@ private:
     struct fd_poll_state {
         std::vector<task_poll_state> tasks;
         uint32_t events = 0; // events this fd is registered for
+        //! registered edge triggered until forget() instead of oneshot per wait
+        bool persistent = false;
+        //! persistent only, events that arrived while nobody was waiting
+        uint32_t ready = 0;
+    };
+
+    //! a socket op submitted to the ring, lives on the waiting task's stack
+    struct uring_op {
+        ptr<task::impl> t;
+        int res = 0;
+        bool done = false;
+
+        explicit uring_op(ptr<task::impl> t_) : t{t_} {}
     };
 
     typedef std::vector<fd_poll_state> fd_array;
@@ -33,21 +48,79 @@ private:
     //! timerfd used for breaking epoll_wait for timeouts
     // required because the timeout value for epoll_wait is not accurate
     timer_fd _tfd;
+    //! absolute time _tfd is armed for, unset once it fires
+    optional<kernel::time_point> _tfd_armed;
     //! the epoll fd used for io in this runner
     epoll_fd _efd;
     //! number of fds we've been asked to wait on
     size_t _npollfds = 0;
+    //! only with the io_uring backend, epoll is still used for fdwait/poll
+    std::unique_ptr<uring> _uring;
+    //! is there a poll on _efd in the ring
+    bool _efd_polled = false;
+    //! persistent fds other threads closed, dropped before the next wait
+    std::mutex _closed_mutex;
+    std::vector<int> _closed_fds;
+    std::atomic<bool> _has_closed_fds{false};
+    //! ready tasks left to run before submitting queued sqes
+    size_t _submit_countdown = -1;
+    //! events asked of each epoll_wait, grows when a wait fills it
+    //! and shrinks when waits come back mostly empty
+    size_t _batch = 64;
+    size_t _min_batch = 16;
+    size_t _max_batch = 1024;
+    //! epoll_wait calls and the events they returned
+    uint64_t _waits = 0;
+    uint64_t _nevents = 0;
 private:
-    void add_pollfds(ptr<task::impl> t, pollfd *fds, nfds_t nfds);
+    int add_pollfds(ptr<task::impl> t, pollfd *fds, nfds_t nfds);
+    //! reset fd's persistent state, and unregister it if still open
+    void drop(int fd, bool unregister);
+    void drop_closed_fds();
     int remove_pollfds(pollfd *fds, nfds_t nfds);
+    void dispatch_events(int ms);
+    //! make sure _tfd fires at when, only calls timerfd_settime if it changed
+    void arm_timer(kernel::time_point when);
+
+    io_uring_sqe *prep(uint8_t opcode, int fd, uring_op &op);
+    int complete(uring_op &op, optional_timeout ms);
+    bool reap();
 public:
     io();
+    ~io();
+
+    //! true when socket ops go through io_uring
+    bool has_uring() const { return _uring != nullptr; }
+
+    //! io_uring versions of the socket calls.
+    //! return -1 and set errno like the syscalls, ETIMEDOUT on timeout
+    ssize_t recv(int fd, void *buf, size_t len, int flags, optional_timeout ms);
+    ssize_t send(int fd, const void *buf, size_t len, int flags, optional_timeout ms);
+    int accept(int fd, sockaddr *addr, socklen_t *addrlen, int flags, optional_timeout ms);
+    int connect(int fd, const sockaddr *addr, socklen_t addrlen, optional_timeout ms);
+
+    //! called every scheduler iteration with the number of ready tasks
+    void check_completions(size_t nready);
 
     bool fdwait(int fd, int rw, optional_timeout ms);
     int poll(pollfd *fds, nfds_t nfds, optional_timeout ms);
 
+    //! register fd once for reading and writing, edge triggered,
+    //! so waiting on it doesn't need epoll_ctl
+    void persist(int fd);
+    //! undo persist
+    void forget(int fd);
+    //! fd is about to be closed by any thread, see fd_closing
+    static void closing(int fd) noexcept;
+
     void wakeup();
     void wait(optional<kernel::time_point> when);
+
+    //! see kernel::set_io_batch
+    void set_batch(size_t min_events, size_t max_events);
+    size_t batch() const { return _batch; }
+    uint64_t waits() const { return _waits; }
+    uint64_t events() const { return _nevents; }
 };
 
 } // end namespace ten
@@ -1,4 +1,6 @@
 #include "thread_context.hh"
+#include "uring.hh"
+#include "ten/task/qutex.hh"
 #include <sys/syscall.h>
 
 namespace ten {
@@ -8,6 +10,7 @@ bool glog_inited;
 namespace {
     std::once_flag boot_flag;
     void *signal_stack; // for valgrind
+    kernel::io_backend io_backend_ = kernel::io_backend::epoll;
 }
 
 static void kernel_boot() {
@@ -73,17 +76,83 @@ void kernel::boot() {
     std::call_once(boot_flag, kernel_boot);
 }
 
+kernel::io_backend kernel::backend() {
+    return io_backend_;
+}
+
 void kernel::wait_for_tasks() {
     this_ctx->scheduler.wait_for_all();
 }
 
-kernel::kernel(optional<size_t> stacksize) {
+void kernel::set_work_stealing(bool enable) {
+    this_ctx->scheduler.set_work_stealing(enable);
+}
+
+void kernel::set_busy_poll(duration budget) {
+    this_ctx->scheduler.set_busy_poll(budget);
+}
+
+void kernel::set_io_batch(size_t min_events, size_t max_events) {
+    this_ctx->scheduler.get_io().set_batch(min_events, max_events);
+}
+
+void kernel::set_run_budget(size_t tasks, duration time) {
+    this_ctx->scheduler.set_run_budget(tasks, time);
+}
+
+kernel::loop_counts kernel::loop_stats() {
+    return this_ctx->scheduler.loop_stats();
+}
+
+bool kernel::use_stack_arena(size_t max_stacks, bool hugepages) {
+    return stack_allocator::use_arena(stack_allocator::default_stacksize,
+            max_stacks, hugepages);
+}
+
+void kernel::set_stack_cache_watermarks(size_t low, size_t high, size_t depot_max) {
+    stack_allocator::set_cache_watermarks(low, high, depot_max);
+}
+
+void kernel::set_stack_sampling(uint32_t one_in) {
+    stack_allocator::sample_every.store(one_in);
+}
+
+kernel::stack_cache_counts kernel::stack_cache_stats() {
+    return stack_allocator::stats();
+}
+
+void kernel::set_qutex_spin(uint32_t max_spins) {
+    qutex::max_spin.store(max_spins);
+}
+
+kernel::qutex_counts kernel::qutex_stats() {
+    qutex_counts c;
+    c.spun = qutex::spun.load(std::memory_order_relaxed);
+    c.parked = qutex::parked.load(std::memory_order_relaxed);
+    return c;
+}
+
+void kernel::set_task_profiling(bool enable) {
+    task_profiler::enable(enable);
+}
+
+void kernel::set_watchdog(duration stall, int signo) {
+    thread_context::set_watchdog(stall, signo);
+}
+
+kernel::kernel(optional<size_t> stacksize, io_backend backend) {
     if (stacksize) {
         CHECK(*stacksize >= stack_allocator::min_stacksize);
         (void)stack_allocator::initialize(); // ensure static init done
         stack_allocator::default_stacksize = *stacksize;
     }
     boot();
+    if (backend == io_backend::uring && !uring::supported()) {
+        LOG(WARNING) << "io_uring not supported, using epoll";
+        backend = io_backend::epoll;
+    }
+    // threads create their io lazily, so set before any tasks run
+    io_backend_ = backend;
 }
 
 kernel::~kernel() {
@@ -1,16 +1,31 @@
 #include "ten/net.hh"
+#include "thread_context.hh"
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
 
 static void set_errno_from(int fd, int default_err) {
     int e = default_err;
     socklen_t len = sizeof e;
-    (void)::getsockopt(fd, SOL_SOCKET, SO_ERROR, &e, &len);
+    // SO_ERROR is 0 when the socket itself is fine, as after a timeout
+    if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &e, &len) == -1 || e == 0)
+        e = default_err;
     errno = e;
 }
 
 namespace ten {
 
+static io *uring_io() {
+    if (kernel::backend() != kernel::io_backend::uring) return nullptr;
+    io &i = this_ctx->scheduler.get_io();
+    return i.has_uring() ? &i : nullptr;
+}
+
 // on timeout, caller should close, since the kernel may still be trying to connect
 int netconnect(int fd, const address &addr, optional_timeout ms) {
+    if (io *u = uring_io()) {
+        task::impl::cancellation_point cancellable;
+        return u->connect(fd, addr.sockaddr(), addr.addrlen(), ms) == -1 ? -1 : 0;
+    }
     while (::connect(fd, addr.sockaddr(), addr.addrlen()) < 0) {
         if (errno == EINTR)
             continue;
@@ -29,6 +44,10 @@ int netconnect(int fd, const address &addr, optional_timeout ms) {
 int netaccept(int fd, address &addr, int flags, optional_timeout timeout_ms) {
     int nfd;
     socklen_t addrlen = addr.maxlen();
+    if (io *u = uring_io()) {
+        task::impl::cancellation_point cancellable;
+        return u->accept(fd, addr.sockaddr(), &addrlen, flags | SOCK_NONBLOCK, timeout_ms);
+    }
     while ((nfd = ::accept4(fd, addr.sockaddr(), &addrlen, flags | SOCK_NONBLOCK)) < 0) {
         if (errno == EINTR)
             continue;
@@ -43,6 +62,10 @@ int netaccept(int fd, address &addr, int flags, optional_timeout timeout_ms) {
 }
 
 ssize_t netrecv(int fd, void *buf, size_t len, int flags, optional_timeout timeout_ms) {
+    if (io *u = uring_io()) {
+        task::impl::cancellation_point cancellable;
+        return u->recv(fd, buf, len, flags, timeout_ms);
+    }
     ssize_t nr;
     while ((nr = ::recv(fd, buf, len, flags)) < 0) {
         if (errno == EINTR)
@@ -59,6 +82,17 @@ ssize_t netrecv(int fd, void *buf, size_t len, int flags, optional_timeout timeo
 
 ssize_t netsend(int fd, const void *buf, size_t len, int flags, optional_timeout timeout_ms) {
     size_t total_sent=0;
+    if (io *u = uring_io()) {
+        task::impl::cancellation_point cancellable;
+        while (total_sent < len) {
+            ssize_t nw = u->send(fd, &((const char *)buf)[total_sent], len-total_sent, flags, timeout_ms);
+            if (nw == -1) {
+                return total_sent ? total_sent : -1;
+            }
+            total_sent += nw;
+        }
+        return total_sent;
+    }
     while (total_sent < len) {
         ssize_t nw = ::send(fd, &((const char *)buf)[total_sent], len-total_sent, flags);
         if (nw == -1) {
@@ -85,6 +119,207 @@ ssize_t netsend(int fd, const void *buf, size_t len, int flags, optional_timeout
     return total_sent;
 }
 
+// the vectored calls wait in epoll with either backend,
+// fdwait works alongside io_uring
+
+ssize_t netrecvv(int fd, const iovec *iov, size_t iovcnt, int flags, optional_timeout timeout_ms) {
+    msghdr msg{};
+    msg.msg_iov = const_cast<iovec *>(iov);
+    msg.msg_iovlen = std::min<size_t>(iovcnt, IOV_MAX);
+    ssize_t nr;
+    while ((nr = ::recvmsg(fd, &msg, flags)) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (!io_not_ready())
+            break;
+        if (!fdwait(fd, 'r', timeout_ms)) {
+            set_errno_from(fd, ETIMEDOUT);
+            break;
+        }
+    }
+    return nr;
+}
+
+ssize_t netsendv(int fd, const iovec *iov, size_t iovcnt, int flags, optional_timeout timeout_ms) {
+    // the caller's iovecs are only copied if a write comes up short
+    std::vector<iovec> rest;
+    size_t total_sent = 0;
+    while (iovcnt > 0) {
+        msghdr msg{};
+        msg.msg_iov = const_cast<iovec *>(iov);
+        msg.msg_iovlen = std::min<size_t>(iovcnt, IOV_MAX);
+        ssize_t nw = ::sendmsg(fd, &msg, flags);
+        if (nw == -1) {
+            if (errno == EINTR)
+                continue;
+            if (!io_not_ready()) {
+                return total_sent ? total_sent : -1;
+            }
+            if (!fdwait(fd, 'w', timeout_ms)) {
+                if (total_sent)
+                    return total_sent;
+                set_errno_from(fd, ETIMEDOUT);
+                return -1;
+            }
+            continue;
+        }
+        total_sent += nw;
+        // skip what was written, splitting the buffer it stopped in
+        size_t n = nw;
+        while (iovcnt > 0 && n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (n > 0) {
+            if (rest.empty()) {
+                rest.assign(iov, iov + iovcnt);
+                iov = rest.data();
+            }
+            // iov points into rest now
+            iovec &first = rest[iov - rest.data()];
+            first.iov_base = static_cast<char *>(first.iov_base) + n;
+            first.iov_len -= n;
+        }
+    }
+    return total_sent;
+}
+
+ssize_t netsendfile(int fd, int in_fd, off_t offset, size_t len, optional_timeout timeout_ms) {
+    struct stat st;
+    const bool from_pipe = ::fstat(in_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    size_t total_sent = 0;
+    while (total_sent < len) {
+        ssize_t nw;
+        if (from_pipe) {
+            nw = ::splice(in_fd, nullptr, fd, nullptr, len - total_sent,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        } else {
+            nw = ::sendfile(fd, in_fd, &offset, len - total_sent);
+        }
+        if (nw == 0) break; // end of file, or the pipe's writer is gone
+        if (nw > 0) {
+            total_sent += nw;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (!io_not_ready()) {
+            return total_sent ? total_sent : -1;
+        }
+        // an empty pipe and a full socket both say EAGAIN
+        int wait_fd = fd;
+        int rw = 'w';
+        int avail = 0;
+        if (from_pipe && ::ioctl(in_fd, FIONREAD, &avail) == 0 && avail == 0) {
+            wait_fd = in_fd;
+            rw = 'r';
+        }
+        if (!fdwait(wait_fd, rw, timeout_ms)) {
+            if (total_sent)
+                return total_sent;
+            set_errno_from(fd, ETIMEDOUT);
+            return -1;
+        }
+    }
+    return total_sent;
+}
+
+// how much one splice asks for, the default pipe capacity
+static const size_t splice_chunk = 64 * 1024;
+
+// unlike fdwait, a hangup or error counts as ready, since there may still be
+// data to read before the end, and the next splice says which it is
+static bool splice_wait(int fd, int rw, optional_timeout timeout_ms) {
+    pollfd pfd{fd, short(rw == 'r' ? POLLIN : POLLOUT), 0};
+    return taskpoll(&pfd, 1, timeout_ms) > 0;
+}
+
+int netsplice(int from, int to, optional_timeout timeout_ms, uint64_t &moved) {
+    pipe_fd p{O_NONBLOCK};
+    size_t in_pipe = 0;
+    for (;;) {
+        // the pipe is empty here, so EAGAIN can only mean from has nothing
+        ssize_t nr = ::splice(from, nullptr, p.w.fd, nullptr, splice_chunk,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (nr == 0) break;
+        if (nr < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!io_not_ready())
+                return -1;
+            if (!splice_wait(from, 'r', timeout_ms)) {
+                set_errno_from(from, ETIMEDOUT);
+                return -1;
+            }
+            continue;
+        }
+        in_pipe = nr;
+        // and here the pipe has data, so EAGAIN means to is full
+        while (in_pipe) {
+            ssize_t nw = ::splice(p.r.fd, nullptr, to, nullptr, in_pipe,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (nw > 0) {
+                in_pipe -= nw;
+                moved += nw;
+                continue;
+            }
+            if (nw == 0) {
+                errno = EPIPE;
+                return -1;
+            }
+            if (errno == EINTR)
+                continue;
+            if (!io_not_ready())
+                return -1;
+            if (!splice_wait(to, 'w', timeout_ms)) {
+                set_errno_from(to, ETIMEDOUT);
+                return -1;
+            }
+        }
+    }
+    ::shutdown(to, SHUT_WR);
+    return 0;
+}
+
+netproxy_stats netproxy(netsock &a, netsock &b, optional_timeout timeout_ms) {
+    netproxy_stats st;
+    // an error one way ends the other way too, instead of leaving
+    // it waiting on a peer that is gone
+    auto relay = [&](netsock &from, netsock &to, uint64_t &moved, int &err) {
+        if (netsplice(from.s.fd, to.s.fd, timeout_ms, moved) == -1) {
+            err = errno;
+            ::shutdown(a.s.fd, SHUT_RDWR);
+            ::shutdown(b.s.fd, SHUT_RDWR);
+        }
+    };
+    // pinned, it shares this stack frame and must stay on this thread
+    task other = task::spawn_pinned([&] {
+        relay(b, a, st.b_to_a, st.b_to_a_error);
+    });
+    try {
+        relay(a, b, st.a_to_b, st.a_to_b_error);
+    } catch (...) {
+        // other uses this stack frame
+        other.cancel();
+        other.join();
+        throw;
+    }
+    other.join();
+    return st;
+}
+
+void netpersist(int fd) {
+    // with io_uring the socket calls don't wait in epoll
+    if (uring_io()) return;
+    this_ctx->scheduler.get_io().persist(fd);
+}
+
+void netforget(int fd) {
+    if (uring_io()) return;
+    this_ctx->scheduler.get_io().forget(fd);
+}
+
 void netsock::dial(const char *addr, uint16_t port, optional_timeout timeout_ms) {
     netdial(s.fd, addr, port, timeout_ms);
 }
@@ -3,20 +3,63 @@
 
 namespace ten {
 
+std::atomic<uint32_t> qutex::max_spin{200};
+std::atomic<uint64_t> qutex::spun{0};
+std::atomic<uint64_t> qutex::parked{0};
+
+// with lk held and the qutex owned by another task, spin while the owner
+// is running on another thread and nothing else here wants to run.
+// the spin limit follows how long recent contended locks took,
+// like glibc's PTHREAD_MUTEX_ADAPTIVE_NP. returns with lk held.
+bool qutex::spin(std::unique_lock<std::mutex> &lk, ptr<task::impl> t) {
+    const uint32_t max = max_spin.load(std::memory_order_relaxed);
+    const uint32_t hint = _spin_hint;
+    const uint32_t limit = std::min(max, hint * 2 + 10);
+    uint32_t n = 0;
+    while (n < limit && _owner->on_cpu() && !scheduler::has_ready_tasks()) {
+        lk.unlock();
+        // watch _locked so the owner can unlock without fighting us for _m,
+        // but come back now and then to see if the owner went to sleep
+        const uint32_t until = std::min(limit, n + 16);
+        do {
+            cpu_relax();
+            ++n;
+        } while (n < until && _locked.load(std::memory_order_relaxed));
+        lk.lock();
+        if (_owner == nullptr) {
+            _owner = t;
+            _locked.store(true, std::memory_order_relaxed);
+            _spin_hint = hint + (int32_t(n) - int32_t(hint)) / 8;
+            spun.fetch_add(1, std::memory_order_relaxed);
+            DVLOG(5) << "LOCK qutex: " << this << " owner: " << _owner << " spins: " << n;
+            return true;
+        }
+    }
+    // gave up or didn't try, spin less next time
+    _spin_hint = hint - hint / 8;
+    return false;
+}
+
 void qutex::lock(lock_type_t lt) {
     const auto t = scheduler::current_task();
     DCHECK(!t->cancelable()) << "BUG: cannot cancel a lock";
     DCHECK(t) << "BUG: qutex::lock called outside of task";
+    wait_node node{t};
     {
-        std::lock_guard<std::mutex> lk{_m};
+        std::unique_lock<std::mutex> lk{_m};
         DCHECK(_owner != t) << "no recursive locking: " << t;
         if (_owner == nullptr) {
             _owner = t;
+            _locked.store(true, std::memory_order_relaxed);
             DVLOG(5) << "LOCK qutex: " << this << " owner: " << _owner;
             return;
         }
+        if (spin(lk, t)) {
+            return;
+        }
         DVLOG(5) << "QUTEX[" << this << "] lock waiting add: " << t <<  " owner: " << _owner;
-        _waiting.push_back(t);
+        _waiting.push_back(node);
+        parked.fetch_add(1, std::memory_order_relaxed);
     }
 
     // loop to handle spurious wakeups from other threads
@@ -39,7 +82,12 @@ void qutex::lock(lock_type_t lt) {
     } catch (...) {
         // deadline timeouts can trigger this
         std::lock_guard<std::mutex> lk{_m};
-        unlock_or_giveup(lk);
+        if (_owner == t) {
+            // it was handed to us on the way out
+            hand_off(lk);
+        } else {
+            _waiting.remove(node);
+        }
         throw;
     }
 }
@@ -51,40 +99,32 @@ bool qutex::try_lock() {
     if (lk.owns_lock()) {
         if (_owner == nullptr) {
             _owner = t;
+            _locked.store(true, std::memory_order_relaxed);
             return true;
         }
     }
     return false;
 }
 
-void qutex::unlock_or_giveup(std::lock_guard<std::mutex> &lk) noexcept {
-    const auto current_task = scheduler::current_task();
-    DVLOG(5) << "QUTEX[" << this << "] unlock: " << current_task;
-    if (current_task == _owner) {
-        ptr<task::impl> new_owner;
-        if (!_waiting.empty()) {
-            new_owner = _waiting.front();
-            _waiting.pop_front();
-        }
-        _owner = new_owner;
-        DVLOG(5) << "UNLOCK qutex: " << this
-            << " new owner: " << new_owner
-            << " waiting: " << _waiting.size();
-        if (new_owner) new_owner->ready();
-    } else {
-        // this branch is taken when exception is thrown inside
-        // a task that is currently waiting inside qutex::lock
-        // give up trying to acquire the lock
-        auto i = std::find(_waiting.begin(), _waiting.end(), current_task);
-        if (i != _waiting.end()) {
-            _waiting.erase(i);
-        }
+void qutex::hand_off(std::lock_guard<std::mutex> &lk) noexcept {
+    DVLOG(5) << "QUTEX[" << this << "] unlock: " << _owner;
+    ptr<task::impl> new_owner;
+    if (wait_node *n = _waiting.pop_front()) {
+        new_owner = n->t;
     }
+    _owner = new_owner;
+    _locked.store(bool(new_owner), std::memory_order_relaxed);
+    DVLOG(5) << "UNLOCK qutex: " << this
+        << " new owner: " << new_owner
+        << " waiting: " << _waiting.size();
+    if (new_owner) new_owner->ready();
 }
 
 void qutex::unlock() {
     std::lock_guard<std::mutex> lk{_m};
-    unlock_or_giveup(lk);
+    if (_owner == scheduler::current_task()) {
+        hand_off(lk);
+    }
 }
 
 } // namespace
@@ -1,19 +1,20 @@
 #include "ten/task/rendez.hh"
-#include "scheduler.hh"
+#include "thread_context.hh"
 #include <mutex>
+#include <memory>
+#include <algorithm>
 
 namespace ten {
 
 void rendez::sleep(std::unique_lock<qutex> &lk) {
     DCHECK(lk.owns_lock()) << "must own lock before calling rendez::sleep";
     const auto t = scheduler::current_task();
+    wait_node node{t};
 
     {
         std::lock_guard<std::mutex> ll(_m);
-        DCHECK(std::find(_waiting.begin(), _waiting.end(), t) == _waiting.end())
-            << "BUG: " << t << " already waiting on rendez " << this;
         DVLOG(5) << "RENDEZ[" << this << "] PUSH BACK: " << t;
-        _waiting.push_back(t);
+        _waiting.push_back(node);
     }
     // must hold the lock until we're in the waiting list
     // otherwise another thread might modify the condition and
@@ -29,10 +30,7 @@ void rendez::sleep(std::unique_lock<qutex> &lk) {
     } catch (...) {
         {
             std::lock_guard<std::mutex> ll(_m);
-            auto i = std::find(_waiting.begin(), _waiting.end(), t);
-            if (i != _waiting.end()) {
-                _waiting.erase(i);
-            }
+            _waiting.remove(node);
         }
         lk.lock();
         throw;
@@ -43,9 +41,9 @@ void rendez::wakeup() {
     ptr<task::impl> t = nullptr;
     {
         std::lock_guard<std::mutex> lk(_m);
-        if (!_waiting.empty()) {
-            t = _waiting.front();
-            _waiting.pop_front();
+        // the node belongs to the waiter, don't touch it after unlocking
+        if (wait_node *n = _waiting.pop_front()) {
+            t = n->t;
         }
     }
 
@@ -54,22 +52,151 @@ void rendez::wakeup() {
 }
 
 void rendez::wakeupall() {
-    std::deque<ptr<task::impl>> waiting;
-    {
-        std::lock_guard<std::mutex> lk(_m);
-        std::swap(waiting, _waiting);
+    // ready them while locked, a node can go away as soon as it's unlinked
+    std::lock_guard<std::mutex> lk(_m);
+    while (wait_node *n = _waiting.pop_front()) {
+        DVLOG(5) << "RENDEZ[" << this << "] " << scheduler::current_task() << " wakeupall: " << n->t;
+        n->t->ready();
     }
+}
+
+void rendez::add_waiter(wait_node &n) {
+    std::lock_guard<std::mutex> ll(_m);
+    DVLOG(5) << "RENDEZ[" << this << "] SELECT PUSH BACK: " << n.t;
+    _waiting.push_back(n);
+}
+
+bool rendez::remove_waiter(wait_node &n) {
+    std::lock_guard<std::mutex> ll(_m);
+    return _waiting.remove(n);
+}
 
-    for (auto t : waiting) {
-        DVLOG(5) << "RENDEZ[" << this << "] " << scheduler::current_task() << " wakeupall: " << t;
-        t->ready();
+namespace {
+
+//! n items on the stack when n <= N, so small selects don't allocate
+template <class T, size_t N>
+class select_array {
+    T _inline[N];
+    std::unique_ptr<T[]> _heap;
+    T *_p;
+public:
+    explicit select_array(size_t n)
+        : _heap(n > N ? new T[n] : nullptr),
+          _p(n > N ? _heap.get() : _inline) {}
+
+    select_array(const select_array &) = delete;
+    select_array &operator = (const select_array &) = delete;
+
+    T &operator [](size_t i) { return _p[i]; }
+    T *begin() { return _p; }
+};
+
+//! typical selects have a handful of cases
+constexpr size_t inline_cases = 8;
+
+} // anon
+
+optional<size_t> select_wait(select_case **cases, size_t ncases,
+        optional<kernel::time_point> when)
+{
+    const auto t = scheduler::current_task();
+
+    // lock in address order so selects over the same channels can't deadlock
+    select_array<qutex *, inline_cases> locks{ncases};
+    select_array<rendez *, inline_cases> waitqs{ncases};
+    for (size_t i=0; i<ncases; ++i) {
+        locks[i] = &cases[i]->lock();
+        waitqs[i] = &cases[i]->waitq();
+    }
+    std::sort(locks.begin(), locks.begin() + ncases);
+    const size_t nlocks = std::unique(locks.begin(), locks.begin() + ncases) - locks.begin();
+    std::sort(waitqs.begin(), waitqs.begin() + ncases);
+    const size_t nwaitqs = std::unique(waitqs.begin(), waitqs.begin() + ncases) - waitqs.begin();
+    // our place on each waiting list, sized once so they never move
+    select_array<wait_node, inline_cases> nodes{nwaitqs};
+    for (size_t i=0; i<nwaitqs; ++i) nodes[i].t = t;
+    // rendez that woke us while parked
+    select_array<rendez *, inline_cases> woken{nwaitqs};
+    size_t nwoken = 0;
+
+    auto lock_all = [&] {
+        for (size_t i=0; i<nlocks; ++i) locks[i]->lock(qutex::safe_lock);
+    };
+    auto unlock_all = [&] {
+        for (size_t i=nlocks; i>0; --i) locks[i-1]->unlock();
+    };
+    auto unpark = [&] {
+        nwoken = 0;
+        for (size_t i=0; i<nwaitqs; ++i) {
+            if (!waitqs[i]->remove_waiter(nodes[i])) {
+                woken[nwoken++] = waitqs[i];
+            }
+        }
+    };
+    // finish with the locks held, passing on any wakeup we didn't use
+    // because it might have been meant for another waiter
+    auto done = [&](rendez *used) {
+        for (size_t i=0; i<ncases; ++i) {
+            cases[i]->unparking();
+        }
+        for (size_t i=0; i<nwoken; ++i) {
+            if (woken[i] != used) woken[i]->wakeup();
+        }
+        unlock_all();
+    };
+
+    optional<scheduler::alarm_clock::scoped_alarm> timeout_alarm;
+    lock_all();
+    for (;;) {
+        // announce before checking, lock-free channels look for waiters
+        // after their operation without taking the lock
+        for (size_t i=0; i<ncases; ++i) {
+            cases[i]->parking();
+        }
+        try {
+            for (size_t i=0; i<ncases; ++i) {
+                if (cases[i]->try_complete()) {
+                    done(&cases[i]->waitq());
+                    return i;
+                }
+            }
+        } catch (...) {
+            done(nullptr);
+            throw;
+        }
+        if (when && kernel::clock::now() >= *when) {
+            done(nullptr);
+            return nullopt;
+        }
+        if (when && !timeout_alarm) {
+            timeout_alarm.emplace(this_ctx->scheduler.arm_alarm(t, *when));
+        }
+
+        for (size_t i=0; i<nwaitqs; ++i) {
+            waitqs[i]->add_waiter(nodes[i]);
+        }
+        // like rendez::sleep, stay locked until we're on every waiting list
+        unlock_all();
+        try {
+            task::impl::cancellation_point cancellable;
+            t->swap();
+        } catch (...) {
+            lock_all();
+            unpark();
+            done(nullptr);
+            throw;
+        }
+        lock_all();
+        unpark();
+        for (size_t i=0; i<ncases; ++i) {
+            cases[i]->unparking();
+        }
     }
 }
 
 rendez::~rendez() {
-    using ::operator<<;
     std::lock_guard<std::mutex> lk(_m);
-    DCHECK(_waiting.empty()) << "BUG: still waiting: " << _waiting;
+    DCHECK(_waiting.empty()) << "BUG: still waiting: " << _waiting.size() << " tasks";
 }
 
 } // namespace
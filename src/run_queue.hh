@@ -0,0 +1,62 @@
+#ifndef LIBTEN_RUN_QUEUE_HH_
+#define LIBTEN_RUN_QUEUE_HH_
+
+#include "task_impl.hh"
+#include <deque>
+
+namespace ten {
+
+//! tasks ready to run, one fifo per task_priority
+//
+//! popping takes up to weights[level] tasks from each waiting level
+//! per round, most urgent first, so critical tasks get ahead of bulk
+//! work without starving it
+class run_queue {
+public:
+    static constexpr size_t nlevels = 3;
+    static constexpr uint32_t weights[nlevels] = {16, 4, 1};
+private:
+    std::deque<ptr<task::impl>> _q[nlevels];
+    //! tasks each level may still take this round
+    uint32_t _credit[nlevels] = {weights[0], weights[1], weights[2]};
+    size_t _size = 0;
+
+    static size_t level(const ptr<task::impl> &t) {
+        return static_cast<size_t>(t->priority());
+    }
+public:
+    bool empty() const { return _size == 0; }
+    size_t size() const { return _size; }
+
+    void push_back(ptr<task::impl> t) {
+        _q[level(t)].push_back(t);
+        ++_size;
+    }
+
+    //! ahead of the other tasks at the same priority
+    void push_front(ptr<task::impl> t) {
+        _q[level(t)].push_front(t);
+        ++_size;
+    }
+
+    ptr<task::impl> pop() {
+        DCHECK(_size > 0);
+        for (;;) {
+            for (size_t i=0; i<nlevels; ++i) {
+                if (_credit[i] > 0 && !_q[i].empty()) {
+                    --_credit[i];
+                    --_size;
+                    const ptr<task::impl> t = _q[i].front();
+                    _q[i].pop_front();
+                    return t;
+                }
+            }
+            // every level with tasks has had its share
+            std::copy(std::begin(weights), std::end(weights), std::begin(_credit));
+        }
+    }
+};
+
+} // ten
+
+#endif
@@ -1,14 +1,36 @@
 #include "scheduler.hh"
 #include "thread_context.hh"
+#include "ten/metrics.hh"
+#include <execinfo.h>
+#include <ucontext.h>
 
 namespace ten {
 
+constexpr uint32_t run_queue::weights[];
+std::atomic<int> scheduler::watchdog_signal{SIGURG};
+
+namespace {
+    //! schedulers with work stealing enabled
+    synchronized<std::vector<ptr<scheduler>>> stealers;
+    //! number of tasks sitting in all _stealq
+    std::atomic<uint64_t> stealable_tasks{0};
+    //! number of work stealing schedulers blocked in wait
+    std::atomic<uint64_t> idle_stealers{0};
+    //! rotate the first victim so thieves don't all pick the same one
+    std::atomic<uint64_t> victim_seed{0};
+    //! busy_poll gives the cpu away once per this many polls
+    constexpr unsigned busy_poll_yield_every = 16;
+} // anon
+
 scheduler::scheduler()
   : _os_task{std::make_shared<task::impl>()},
     _current_task{_os_task.get()},
-    _canceled{false}
+    _canceled{false},
+    _idle{false},
+    _sleeping{false},
+    _thread{pthread_self()}
 {
-    _os_task->_scheduler.reset(this);
+    _os_task->_scheduler.store(this, std::memory_order_release);
     update_cached_time();
 }
 
@@ -19,13 +41,21 @@ scheduler::~scheduler() {
     //wait_for_all();
     //XXX ^ this was moved to ~thread_context
     // because we need to finish all tasks before removing from thread list
+    set_work_stealing(false);
     CHECK(_user_tasks.empty());
+    DCHECK(_zombies == 0);
     DVLOG(5) << "scheduler freed: " << this;
 }
 
 void scheduler::shutdown() {
     if (!_shutdown_sequence_initiated) {
         _shutdown_sequence_initiated = true;
+        // take back new tasks nobody has stolen so they can be canceled
+        task::impl *t;
+        while (_stealq.pop(t)) {
+            --stealable_tasks;
+            adopt(t, false);
+        }
         for (auto &t : _user_tasks) {
             t->cancel();
         }
@@ -44,7 +74,8 @@ void scheduler::wait_for_all() {
     DCHECK(_current_task.get() == _os_task.get());
     DVLOG(5) << "entering loop";
     _looping = true;
-    while (_user_tasks.size() > 0) {
+    // zombies can still be on their way here from other threads
+    while (_user_tasks.size() > 0 || !_stealq.empty() || _zombies > 0) {
         schedule();
     }
     _looping = false;
@@ -67,10 +98,90 @@ void scheduler::check_canceled() {
 }
 
 void scheduler::check_dirty_queue() {
-    ptr<task::impl> t;
-    while (_dirtyq.pop(t)) {
-        DVLOG(5) << "dirty readying " << t;
-        _readyq.push_front(t);
+    _dirtyq.drain([this](task::impl *t) {
+        DVLOG(5) << "dirty readying " << ptr<task::impl>{t};
+        _readyq.push_front(ptr<task::impl>{t});
+    });
+}
+
+bool scheduler::check_stealq() {
+    // new tasks go to the front of the runqueue, like unstealable ones
+    task::impl *t;
+    if (_stealq.pop(t)) {
+        --stealable_tasks;
+        adopt(t, true);
+        return true;
+    }
+    return false;
+}
+
+bool scheduler::steal() {
+    task::impl *t = nullptr;
+    // hold the lock so victims can't be freed while we look at them
+    stealers([&](std::vector<ptr<scheduler>> &v) {
+        const size_t n = v.size();
+        const size_t first = victim_seed++;
+        for (size_t i=0; i<n; ++i) {
+            const auto victim = v[(first + i) % n];
+            if (victim.get() != this && victim->_stealq.steal(t)) {
+                --stealable_tasks;
+                break;
+            }
+        }
+    });
+    if (t) {
+        DVLOG(5) << this << " stole: " << ptr<task::impl>{t};
+        adopt(t, false);
+        return true;
+    }
+    return false;
+}
+
+void scheduler::adopt(task::impl *t, bool front) {
+    DCHECK(t->_ready);
+    DCHECK(t->_self);
+    t->_scheduler.store(this, std::memory_order_release);
+    add_user_task(std::move(t->_self));
+    if (front) {
+        _readyq.push_front(ptr<task::impl>{t});
+    } else {
+        _readyq.push_back(ptr<task::impl>{t});
+    }
+}
+
+void scheduler::add_user_task(std::shared_ptr<task::impl> t) {
+    t->_task_index = _user_tasks.size();
+    _user_tasks.emplace_back(std::move(t));
+}
+
+void scheduler::wake_idle_sibling() {
+    stealers([this](std::vector<ptr<scheduler>> &v) {
+        for (auto &sched : v) {
+            if (sched.get() != this && sched->_idle) {
+                sched->wakeup();
+                break;
+            }
+        }
+    });
+}
+
+void scheduler::set_work_stealing(bool enable) {
+    if (enable == _work_stealing) return;
+    _work_stealing = enable;
+    const ptr<scheduler> me{this};
+    stealers([=](std::vector<ptr<scheduler>> &v) {
+        if (enable) {
+            v.push_back(me);
+        } else {
+            v.erase(std::remove(begin(v), end(v), me), end(v));
+        }
+    });
+    if (!enable) {
+        task::impl *t;
+        while (_stealq.pop(t)) {
+            --stealable_tasks;
+            adopt(t, false);
+        }
     }
 }
 
@@ -91,47 +202,150 @@ void scheduler::wait(std::unique_lock <std::mutex> &lock, optional<kernel::time_
     // do not wait if _readyq is not empty
     check_dirty_queue();
     if (!_readyq.empty()) return;
-    if (_io) {
+    if (_busy_poll > kernel::duration::zero()) {
+        // other threads' ready() and wakeup() mustn't wait out the budget
         lock.unlock();
-        _io->wait(when);
+        const bool more = busy_poll(when);
         lock.lock();
-    } else {
-        if (when) {
-            _cv.wait_until(lock, *when);
+        if (more) return;
+    }
+    if (_work_stealing) {
+        _idle.store(true);
+        ++idle_stealers;
+        // spawners only wake us if they saw us idle,
+        // so look again now that we've said we are
+        if (stealable_tasks.load() > 0) {
+            --idle_stealers;
+            _idle.store(false);
+            return;
+        }
+    }
+    // other threads only wake us if they see us sleeping,
+    // so look at the dirty queue again now that we've said we are
+    _sleeping.store(true);
+    if (_dirtyq.empty() && !_canceled) {
+        if (_io) {
+            lock.unlock();
+            _io->wait(when);
+            lock.lock();
         } else {
-            _cv.wait(lock);
+            if (when) {
+                _cv.wait_until(lock, *when);
+            } else {
+                _cv.wait(lock);
+            }
         }
     }
+    _sleeping.store(false);
+    if (_work_stealing) {
+        --idle_stealers;
+        _idle.store(false);
+    }
     update_cached_time();
+    polled_io();
 }
 
-void scheduler::schedule() {
-    if (_looping && _user_tasks.size() == 0) {
-        // XXX: ugly hack
-        // this should resume in ::wait_for_all()
-        // which should only be called from os task.
-        // the purpose of this is to allow other tasks to exit
-        // while the os task sticks around, then swap to the
-        // os task which will exit the thread/process
-        _os_task->ready();
+bool scheduler::busy_poll(optional<kernel::time_point> when) {
+    auto until = update_cached_time() + _busy_poll;
+    if (when && *when < until) {
+        until = *when;
     }
+    // wakeups from before this went through the eventfd or _cv
+    _woken.store(false);
+    _polling.store(true);
+    bool more = false;
+    for (unsigned spins = 1; ; ++spins) {
+        if (_io) {
+            // a timeout equal to now doesn't block or arm the timerfd
+            _io->wait(_now);
+            polled_io();
+        }
+        check_dirty_queue();
+        if (!_readyq.empty() || _canceled || _woken.load(std::memory_order_relaxed)) {
+            more = true;
+            break;
+        }
+        if (update_cached_time() >= until) break;
+        if (_work_stealing && stealable_tasks.load(std::memory_order_relaxed) > 0) {
+            more = true;
+            break;
+        }
+        // now and then let whatever we are waiting for have the cpu,
+        // in case it shares ours
+        if (spins % busy_poll_yield_every == 0) {
+            std::this_thread::yield();
+        } else {
+            cpu_relax();
+        }
+    }
+    _polling.store(false);
+    // a wakeup that saw _polling only set _woken
+    if (_woken.exchange(false)) more = true;
+    // or a timer is due, go around again to fire it
+    return more || (when && _now >= *when);
+}
+
+void scheduler::schedule() {
     const auto saved_task = _current_task;
+    // blocked in here until some task is ready, nobody should spin on us
+    saved_task->_on_cpu.store(false, std::memory_order_relaxed);
+    if (saved_task->_profile) {
+        saved_task->_profile->switched_out(task_profiler::ticks());
+    }
     try {
-        do {
-            check_canceled();
-            check_dirty_queue();
-            check_timeout_tasks();
-            if (_readyq.empty()) {
-                auto when = _alarms.when();
-                std::unique_lock<std::mutex> lock{_mutex};
-                wait(lock, when);
-            }
-        } while (_readyq.empty());
-        const auto t = _readyq.front();
-        _readyq.pop_front();
+        ptr<task::impl> t;
+        for (;;) {
+            do {
+                if (_looping && _user_tasks.size() == 0 && _stealq.empty()) {
+                    // XXX: ugly hack
+                    // this should resume in ::wait_for_all()
+                    // which should only be called from os task.
+                    // the purpose of this is to allow other tasks to exit
+                    // while the os task sticks around, then swap to the
+                    // os task which will exit the thread/process
+                    // checked every time around because a thief
+                    // might take our last task while we are waiting
+                    _os_task->ready();
+                }
+                ++_iterations;
+                check_canceled();
+                check_dirty_queue();
+                check_timeout_tasks();
+                if (_io) {
+                    if (!_readyq.empty() && run_budget_spent()) {
+                        // don't let a long ready queue keep new io waiting
+                        _io->wait(_now);
+                        ++_budget_polls;
+                        polled_io();
+                    }
+                    _io->check_completions(_readyq.size());
+                }
+                check_stealq();
+                if (_readyq.empty() && _work_stealing) {
+                    steal();
+                }
+                if (_readyq.empty()) {
+                    auto when = _alarms.when();
+                    std::unique_lock<std::mutex> lock{_mutex};
+                    wait(lock, when);
+                }
+            } while (_readyq.empty());
+            t = _readyq.pop();
+            ++_ran_since_poll;
+            if (!t->_exited) break;
+            // readied while exiting, see remove_task
+            --_zombies;
+            _gctasks.emplace_back(std::move(t->_self));
+        }
         DCHECK(t->_ready);
         t->_ready.store(false);
         _current_task = t;
+        _switches.store(_switches.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+        t->_on_cpu.store(true, std::memory_order_relaxed);
+        if (task_profiler::on()) {
+            account_switch(t.get());
+        }
         DVLOG(5) << this << " swapping to: " << t;
 #ifdef TEN_TASK_TRACE
         saved_task->_trace.capture();
@@ -148,50 +362,85 @@ void scheduler::schedule() {
     }
 }
 
+void scheduler::account_switch(task::impl *t) {
+    if (!t->_profile) {
+        t->_profile.reset(new task_profile);
+    }
+    task_profile &p = *t->_profile;
+    p.switched_in(t->_ready_at, task_profiler::ticks());
+    t->_ready_at = 0;
+    if (p.switches >= task_profiler::flush_every) {
+        p.flush(t->getname());
+    }
+}
+
 void scheduler::attach_task(std::shared_ptr<task::impl> t) {
-    DCHECK(t->_scheduler.get() == nullptr);
-    t->_scheduler.reset(this);
-    _user_tasks.emplace_back(std::move(t));
+    DCHECK(t->_scheduler.load() == nullptr);
+    t->_scheduler.store(this, std::memory_order_release);
+    add_user_task(std::move(t));
+}
+
+void scheduler::attach_stealable_task(std::shared_ptr<task::impl> t) {
+    DCHECK(_work_stealing);
+    DCHECK(t->_scheduler.load() == nullptr);
+    t->_scheduler.store(this, std::memory_order_release);
+    // ready, but not in any runqueue until popped or stolen
+    t->_ready.store(true);
+    t->mark_ready();
+    task::impl *raw = t.get();
+    raw->_self = std::move(t);
+    _stealq.push(raw);
+    ++stealable_tasks;
+    if (idle_stealers.load() > 0) {
+        wake_idle_sibling();
+    }
 }
 
 void scheduler::remove_task(ptr<task::impl> t) {
     DCHECK(t);
-    DCHECK(t->_scheduler.get() == this);
+    DCHECK(t->_scheduler.load() == this);
+    const size_t i = t->_task_index;
+    DCHECK(i < _user_tasks.size() && _user_tasks[i].get() == t.get());
     // set _ready to true here so task::cancel won't work
     // after the task has been removed from the scheduler
     if (t->_ready.exchange(true) == true) {
         // another thread made us ready while we were exiting
         // this can happen with cancel or deadline for example
-        // while waiting on a qutex or rendez
-        auto i = find(begin(_readyq), end(_readyq), t);
-        while (i == end(_readyq)) {
-            sched_yield();
-            check_dirty_queue();
-            i = find(begin(_readyq), end(_readyq), t);
-        }
-        _readyq.erase(i);
-    }
-    DCHECK(find(begin(_readyq), end(_readyq), t) == end(_readyq))
-        << "BUG: " << t << " found in _readyq while being deleted";
-    auto i = find_if(begin(_user_tasks), end(_user_tasks), [=](std::shared_ptr<task::impl> &tt) -> bool {
-        return tt.get() == t.get();
-    });
-    DCHECK(i != end(_user_tasks));
-    _gctasks.emplace_back(*i);
-    _user_tasks.erase(i);
+        // while waiting on a qutex or rendez. it is in _readyq,
+        // or soon will be through _dirtyq, so keep it alive
+        // until schedule() pops it instead of searching for it
+        t->_exited = true;
+        t->_self = _user_tasks[i];
+        ++_zombies;
+    } else {
+        _gctasks.emplace_back(_user_tasks[i]);
+    }
+    // swap with the last task so removal is O(1)
+    if (i != _user_tasks.size() - 1) {
+        _user_tasks[i] = std::move(_user_tasks.back());
+        _user_tasks[i]->_task_index = i;
+    }
+    _user_tasks.pop_back();
 }
 
 void scheduler::ready(ptr<task::impl> t, bool front) {
     DVLOG(5) << "readying: " << t;
     if (t->_ready.exchange(true) == false) {
-        if (this != &this_ctx->scheduler) {
-            _dirtyq.push(t);
-            wakeup();
+        t->mark_ready();
+        // a thief can only adopt a ready task, so the owner is fixed from
+        // here on, and the exchange made its store of _scheduler visible
+        scheduler *owner = t->_scheduler.load(std::memory_order_acquire);
+        if (owner != &this_ctx->scheduler) {
+            owner->_dirtyq.push(t.get());
+            // only the first to see it sleeping pays for the wakeup
+            if (owner->_sleeping.load() && owner->_sleeping.exchange(false)) {
+                owner->wakeup();
+            }
         } else {
             if (front) {
-                _readyq.push_front(t);
+                owner->_readyq.push_front(t);
             } else {
-                _readyq.push_back(t);
+                owner->_readyq.push_back(t);
             }
         }
     }
@@ -200,6 +449,7 @@ void scheduler::ready(ptr<task::impl> t, bool front) {
 void scheduler::ready_for_io(ptr<task::impl> t) {
     DVLOG(5) << "readying for io: " << t;
     if (t->_ready.exchange(true) == false) {
+        t->mark_ready();
         _readyq.push_back(t);
     }
 }
@@ -210,19 +460,38 @@ void scheduler::unsafe_ready(ptr<task::impl> t) {
 }
 
 bool scheduler::cancel_task_by_id(uint64_t id) {
-    bool found = false;
     for (auto &t : _user_tasks) {
         if (t->get_id() == id) {
-            found = true;
             t->cancel();
-            break;
+            return true;
         }
     }
-    return found;
+    // not started yet, take it back from the thieves to cancel it.
+    // popped newest first, so push the others back in reverse
+    std::vector<task::impl *> queued;
+    task::impl *t;
+    while (_stealq.pop(t)) {
+        queued.push_back(t);
+    }
+    task::impl *found = nullptr;
+    for (auto i = queued.rbegin(); i != queued.rend(); ++i) {
+        if (!found && (*i)->get_id() == id) {
+            found = *i;
+        } else {
+            _stealq.push(*i);
+        }
+    }
+    if (!found) return false;
+    --stealable_tasks;
+    adopt(found, false);
+    found->cancel();
+    return true;
 }
 
 void scheduler::wakeup() {
-    // TODO: speed this up?
+    _woken.store(true);
+    // busy_poll looks at _woken after clearing _polling, so it can't miss this
+    if (_polling.load()) return;
     std::unique_lock<std::mutex> lock{_mutex};
     if (_io) {
         _io->wakeup();
@@ -243,12 +512,107 @@ void scheduler::dump() const {
         LOG(INFO) << t->_trace.str();
 #endif
     }
+    // new tasks nobody has run yet. only the owner can walk _stealq,
+    // and thieves could free what it shows from under other threads
+    if (this_ctx && &this_ctx->scheduler == this) {
+        _stealq.for_each([](task::impl *t) {
+            LOG(INFO) << "stealable: " << ptr<task::impl>{t};
+        });
+    } else if (!_stealq.empty()) {
+        LOG(INFO) << _stealq.size() << " stealable tasks";
+    }
     FlushLogFiles(INFO);
 }
 
+void scheduler::watch(kernel::time_point now, kernel::duration limit) {
+    // only this thread writes _watch
+    if (!_watch.load(std::memory_order_relaxed)) {
+        _watch_storage.reset(new stall_watch);
+        _watch.store(_watch_storage.get(), std::memory_order_release);
+    }
+    stall_watch &w = *_watch.load(std::memory_order_relaxed);
+    const uint64_t n = _switches.load(std::memory_order_relaxed);
+    // idle in epoll or on the condition variable, or busy polling, is fine
+    if (n != w.seen || _sleeping.load() || _polling.load()) {
+        w.seen = n;
+        w.since = now;
+        w.reported = false;
+        return;
+    }
+    if (w.reported || now - w.since < limit) return;
+    w.reported = true;
+    w.captured.store(false);
+    w.armed.store(true);
+    if (pthread_kill(_thread, watchdog_signal.load()) != 0) {
+        w.armed.store(false);
+        return;
+    }
+    for (int i=0; i<100 && !w.captured.load(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+    const auto stalled_ms = duration_cast<milliseconds>(now - w.since).count();
+    auto m = metrics::record();
+    if (!w.captured.load()) {
+        LOG(WARNING) << "scheduler " << this << " stalled for "
+            << stalled_ms << "ms, no backtrace";
+        m.counter("watchdog", "stalls").incr();
+    } else if (w.still_stalled) {
+        std::unique_ptr<char *, void (*)(void *)> at{backtrace_symbols(&w.pc, 1), free};
+        LOG(WARNING) << "scheduler " << this << " stalled for "
+            << stalled_ms << "ms in task " << w.name << " |" << w.state << "| at "
+            << (at ? at.get()[0] : "?") << "\n" << w.trace.str();
+        m.counter("watchdog", "stalls").incr();
+        m.counter("watchdog", "stalls", task_group(w.name)).incr();
+    }
+    // otherwise it made progress before the signal arrived
+}
+
+// runs in a signal handler: no locks or allocation. backtrace() is safe
+// here only because set_watchdog called it once before installing us
+void scheduler::capture_stall(void *ucontext) noexcept {
+    stall_watch *wp = _watch.load(std::memory_order_acquire);
+    if (!wp || !wp->armed.exchange(false)) return;
+    stall_watch &w = *wp;
+    w.still_stalled = (_switches.load(std::memory_order_relaxed) == w.seen);
+    if (w.still_stalled) {
+        strncpy(w.name, _current_task->getname(), sizeof(w.name));
+        w.name[sizeof(w.name) - 1] = 0;
+        strncpy(w.state, _current_task->getstate(), sizeof(w.state));
+        w.state[sizeof(w.state) - 1] = 0;
+        const mcontext_t &mc = static_cast<ucontext_t *>(ucontext)->uc_mcontext;
+#if defined(__x86_64__)
+        w.pc = reinterpret_cast<void *>(mc.gregs[REG_RIP]);
+#elif defined(__i386__)
+        w.pc = reinterpret_cast<void *>(mc.gregs[REG_EIP]);
+#elif defined(__aarch64__)
+        w.pc = reinterpret_cast<void *>(mc.pc);
+#else
+        (void)mc;
+#endif
+        w.trace.capture();
+    }
+    w.captured.store(true);
+}
+
+kernel::loop_counts scheduler::loop_stats() const {
+    kernel::loop_counts c{};
+    c.iterations = _iterations;
+    c.budget_polls = _budget_polls;
+    if (_io) {
+        c.waits = _io->waits();
+        c.events = _io->events();
+        c.batch = _io->batch();
+    }
+    return c;
+}
+
 ptr<task::impl> scheduler::current_task() {
     return this_ctx->scheduler._current_task;
 }
 
+bool scheduler::has_ready_tasks() {
+    return !this_ctx->scheduler._readyq.empty();
+}
+
 } // ten
 
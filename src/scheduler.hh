@@ -2,13 +2,28 @@
 #define LIBTEN_SCHEDULER_HH
 
 #include <condition_variable>
+#include <pthread.h>
+#include <csignal>
 #include "ten/descriptors.hh"
-#include "ten/llqueue.hh"
+#include "ten/mpsc_queue.hh"
+#include "ten/wsdeque.hh"
 #include "alarm.hh"
 #include "io.hh"
+#include "run_queue.hh"
 
 namespace ten {
 
+//! hint to the cpu that this is a spin loop
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
 // TODO: api to register at-proc-exit cleanup functions
 // this can be used to free io, or other per-proc
 // resources like dns resolving threads, etc.
@@ -26,14 +41,19 @@ public:
 private:
     //! task representing OS allocated stack for this thread
     std::shared_ptr<task::impl> _os_task;
-    //! all other tasks known to this scheduler
-    std::deque<std::shared_ptr<task::impl>> _user_tasks;
+    //! all other tasks known to this scheduler, unordered
+    //! so tasks can be removed in O(1), see task::impl::_task_index
+    std::vector<std::shared_ptr<task::impl>> _user_tasks;
+    //! exited tasks that are still in _readyq or _dirtyq
+    size_t _zombies = 0;
     //! ptr to the currently running task
     ptr<task::impl> _current_task;
     //! queue of tasks ready to run
-    std::deque<ptr<task::impl>> _readyq;
+    run_queue _readyq;
     //! other threads use this to add tasks to ready queue
-    llqueue<ptr<task::impl>> _dirtyq;
+    mpsc_queue<task::impl, &task::impl::_dirty_next> _dirtyq;
+    //! new tasks that idle work stealing schedulers may take
+    wsdeque<task::impl *> _stealq;
     //! epoll io
     optional<io> _io;
     //! tasks to be garbage collected in the next scheduler iteration
@@ -54,10 +74,80 @@ private:
     bool _shutdown_sequence_initiated = false;
     //! main task is looping in wait_for_all
     bool _looping = false;
+    //! share new tasks with and steal from other schedulers
+    bool _work_stealing = false;
+    //! poll for this long before blocking in wait, see kernel::set_busy_poll
+    kernel::duration _busy_poll{};
+    //! tasks to run, or time to run them for, before looking for io
+    //! again while tasks are still ready, see kernel::set_run_budget
+    size_t _run_budget = 0;
+    kernel::duration _run_budget_time{};
+    //! tasks run since io was last polled, and when that was
+    size_t _ran_since_poll = 0;
+    kernel::time_point _last_poll;
+    //! times around the loop in schedule()
+    uint64_t _iterations = 0;
+    //! io polls because the run budget was used up
+    uint64_t _budget_polls = 0;
+    //! blocked in wait with nothing to steal
+    std::atomic<bool> _idle;
+    //! about to block or blocked in wait, other threads
+    //! readying tasks only call wakeup() when this is set
+    std::atomic<bool> _sleeping;
+    //! in busy_poll, which runs without _mutex. wakeup() then only sets
+    //! _woken, and the watchdog doesn't take the spinning for a stall
+    std::atomic<bool> _polling{false};
+    std::atomic<bool> _woken{false};
+    //! bumped every time a task is switched to, only written by this thread
+    std::atomic<uint64_t> _switches{0};
+    //! thread this scheduler runs on
+    const pthread_t _thread;
+
+    //! what the watchdog knows about this scheduler, see kernel::set_watchdog
+    struct stall_watch {
+        //! _switches last seen and when it was first seen
+        uint64_t seen = 0;
+        kernel::time_point since;
+        bool reported = false;
+        //! set just before the signal, so a stray one is ignored
+        std::atomic<bool> armed{false};
+        //! set by capture_stall on the stalled thread
+        std::atomic<bool> captured{false};
+        bool still_stalled = false;
+        char name[16];
+        char state[32];
+        //! where the signal interrupted the thread, symbolized by watch
+        void *pc = nullptr;
+        saved_backtrace trace;
+    };
+    //! made by the watchdog thread before its first signal, and published
+    //! through _watch for the handler
+    std::unique_ptr<stall_watch> _watch_storage;
+    std::atomic<stall_watch *> _watch{nullptr};
 
     void check_canceled();
     void check_dirty_queue();
     void check_timeout_tasks();
+    bool check_stealq();
+    bool steal();
+    void adopt(task::impl *t, bool front);
+    void add_user_task(std::shared_ptr<task::impl> t);
+    void wake_idle_sibling();
+    //! poll io and the dirty queue without blocking for up to _busy_poll,
+    //! true if there is something to do
+    bool busy_poll(optional<kernel::time_point> when);
+    //! ready tasks have run long enough that io should be looked at
+    bool run_budget_spent() const {
+        return (_run_budget && _ran_since_poll >= _run_budget)
+            || (_run_budget_time > kernel::duration::zero()
+                    && _now - _last_poll >= _run_budget_time);
+    }
+    void polled_io() {
+        _ran_since_poll = 0;
+        _last_poll = _now;
+    }
+    //! profiling, t is about to be swapped to
+    void account_switch(task::impl *t);
 
     const kernel::time_point & update_cached_time() {
         _now = kernel::clock::now();
@@ -88,6 +178,8 @@ public:
     void schedule();
 
     void attach_task(std::shared_ptr<task::impl> t);
+    //! add a new task that may be stolen by another scheduler
+    void attach_stealable_task(std::shared_ptr<task::impl> t);
     void remove_task(ptr<task::impl> t);
 
     void wakeup();
@@ -95,6 +187,20 @@ public:
 
     bool cancel_task_by_id(uint64_t id);
 
+    //! see kernel::set_work_stealing
+    void set_work_stealing(bool enable);
+    bool work_stealing() const { return _work_stealing; }
+
+    //! see kernel::set_busy_poll
+    void set_busy_poll(kernel::duration budget) { _busy_poll = budget; }
+
+    //! see kernel::set_run_budget
+    void set_run_budget(size_t tasks, kernel::duration time) {
+        _run_budget = tasks;
+        _run_budget_time = time;
+    }
+    kernel::loop_counts loop_stats() const;
+
     void cancel() {
         _canceled = true;
         wakeup();
@@ -102,11 +208,24 @@ public:
 
     void dump() const;
 
+    //! sent by the watchdog to a stalled scheduler's thread, only
+    //! changed while the watchdog is stopped, see kernel::set_watchdog
+    static std::atomic<int> watchdog_signal;
+
+    //! called by the watchdog thread, reports the task keeping this
+    //! scheduler from switching if it has been running longer than limit
+    void watch(kernel::time_point now, kernel::duration limit);
+    //! called on this scheduler's thread from the watchdog signal handler
+    void capture_stall(void *ucontext) noexcept;
+
     static ptr<task::impl> current_task();
+    //! other tasks on this thread are waiting to run
+    static bool has_ready_tasks();
 private:
     friend class task;
     friend void this_task::yield();
-    void ready(ptr<task::impl> t, bool front=false);
+    //! make t ready on whichever scheduler owns it, from any thread
+    static void ready(ptr<task::impl> t, bool front=false);
     void ready_for_io(ptr<task::impl> t);
     void unsafe_ready(ptr<task::impl> t);
 };
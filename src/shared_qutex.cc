@@ -0,0 +1,150 @@
+#include "ten/task/shared_qutex.hh"
+#include "scheduler.hh"
+
+namespace ten {
+
+void shared_qutex::lock(qutex::lock_type_t lt) {
+    const auto t = scheduler::current_task();
+    DCHECK(t) << "BUG: shared_qutex::lock called outside of task";
+    wait_node w{t};
+    {
+        std::lock_guard<std::mutex> lk{_m};
+        DCHECK(_writer != t) << "no recursive locking: " << t;
+        if (_writer == nullptr && _nreaders == 0 && _writers.empty()) {
+            _writer = t;
+            DVLOG(5) << "LOCK shared_qutex: " << this << " writer: " << t;
+            return;
+        }
+        DVLOG(5) << "SHARED_QUTEX[" << this << "] writer waiting add: " << t;
+        _writers.push_back(w);
+    }
+    wait(w, lt, true);
+}
+
+void shared_qutex::lock_shared(qutex::lock_type_t lt) {
+    const auto t = scheduler::current_task();
+    DCHECK(t) << "BUG: shared_qutex::lock_shared called outside of task";
+    wait_node w{t};
+    {
+        std::lock_guard<std::mutex> lk{_m};
+        DCHECK(_writer != t) << "no recursive locking: " << t;
+        // waiting writers go first
+        if (_writer == nullptr && _writers.empty()) {
+            ++_nreaders;
+            return;
+        }
+        DVLOG(5) << "SHARED_QUTEX[" << this << "] reader waiting add: " << t;
+        _readers.push_back(w);
+    }
+    wait(w, lt, false);
+}
+
+void shared_qutex::wait(wait_node &w, qutex::lock_type_t lt, bool exclusive) {
+    // loop to handle spurious wakeups from other threads
+    try {
+        for (;;) {
+            DCHECK(!w.t->cancelable()) << "BUG: cannot cancel a lock";
+            switch (lt) {
+                case qutex::safe_lock:
+                    w.t->safe_swap(); // don't allow swap to throw on deadline timeout
+                    break;
+                case qutex::interruptable_lock:
+                default:
+                    w.t->swap();
+            }
+            std::lock_guard<std::mutex> lk{_m};
+            // granting takes us off the waiting list
+            if (!w.linked) {
+                break;
+            }
+        }
+    } catch (...) {
+        // deadline timeouts can trigger this
+        std::lock_guard<std::mutex> lk{_m};
+        if (!w.linked) {
+            // got it while on the way out
+            if (exclusive) {
+                release_exclusive();
+            } else {
+                release_shared();
+            }
+        } else {
+            (exclusive ? _writers : _readers).remove(w);
+            // readers might have been waiting only for us
+            if (exclusive && _writer == nullptr && _writers.empty()) {
+                grant_readers();
+            }
+        }
+        throw;
+    }
+}
+
+bool shared_qutex::try_lock() {
+    const auto t = scheduler::current_task();
+    DCHECK(t) << "BUG: shared_qutex::try_lock called outside of task";
+    std::unique_lock<std::mutex> lk{_m, std::try_to_lock};
+    if (lk.owns_lock()) {
+        if (_writer == nullptr && _nreaders == 0 && _writers.empty()) {
+            _writer = t;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool shared_qutex::try_lock_shared() {
+    std::unique_lock<std::mutex> lk{_m, std::try_to_lock};
+    if (lk.owns_lock()) {
+        if (_writer == nullptr && _writers.empty()) {
+            ++_nreaders;
+            return true;
+        }
+    }
+    return false;
+}
+
+void shared_qutex::unlock() {
+    std::lock_guard<std::mutex> lk{_m};
+    DCHECK(_writer == scheduler::current_task())
+        << "BUG: shared_qutex::unlock by non owner " << scheduler::current_task();
+    release_exclusive();
+}
+
+void shared_qutex::unlock_shared() {
+    std::lock_guard<std::mutex> lk{_m};
+    release_shared();
+}
+
+void shared_qutex::release_exclusive() {
+    DVLOG(5) << "UNLOCK shared_qutex: " << this << " writer: " << _writer
+        << " readers waiting: " << _readers.size()
+        << " writers waiting: " << _writers.size();
+    _writer = nullptr;
+    if (!_readers.empty()) {
+        grant_readers();
+    } else if (!_writers.empty()) {
+        grant_writer();
+    }
+}
+
+void shared_qutex::release_shared() {
+    DCHECK(_nreaders > 0) << "BUG: shared_qutex::unlock_shared without lock_shared";
+    if (--_nreaders == 0 && !_writers.empty()) {
+        grant_writer();
+    }
+}
+
+void shared_qutex::grant_writer() {
+    // the node is gone as soon as its task sees it unlinked, which needs _m
+    _writer = _writers.pop_front()->t;
+    _writer->ready();
+}
+
+void shared_qutex::grant_readers() {
+    while (wait_node *w = _readers.pop_front()) {
+        ++_nreaders;
+        w->t->ready();
+    }
+}
+
+} // namespace
@@ -271,6 +271,40 @@ void sslsock::dial(const char *addr, uint16_t port, optional_timeout timeout_ms)
     handshake();
 }
 
+ssize_t sslsock::sendv(const iovec *iov, size_t iovcnt, int flags, optional_timeout timeout_ms) {
+    // up to one full tls record of small buffers is copied together,
+    // bigger ones are written as they are
+    static constexpr size_t join_max = 16 * 1024;
+    std::string joined;
+    ssize_t total = 0;
+    auto write = [&](const void *buf, size_t len) {
+        ssize_t nw = send(buf, len, flags, timeout_ms);
+        if (nw > 0) total += nw;
+        return nw == (ssize_t)len;
+    };
+    for (size_t i=0; i<iovcnt; ++i) {
+        const char *base = static_cast<const char *>(iov[i].iov_base);
+        const size_t len = iov[i].iov_len;
+        if (joined.size() + len <= join_max) {
+            joined.append(base, len);
+            continue;
+        }
+        if (!joined.empty()) {
+            if (!write(joined.data(), joined.size())) return total ? total : -1;
+            joined.clear();
+        }
+        if (len <= join_max) {
+            joined.assign(base, len);
+        } else if (!write(base, len)) {
+            return total ? total : -1;
+        }
+    }
+    if (!joined.empty() && !write(joined.data(), joined.size())) {
+        return total ? total : -1;
+    }
+    return total;
+}
+
 void sslsock::handshake() {
     if (BIO_do_handshake(bio) <= 0) {
         throw sslerror();
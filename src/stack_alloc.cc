@@ -5,6 +5,10 @@
 #include <boost/context/stack_utils.hpp>
 #include <sys/mman.h>
 #include <algorithm>
+#include <cerrno>
+#include <iterator>
+#include <mutex>
+#include <vector>
 
 namespace ten {
 
@@ -18,7 +22,74 @@ namespace {
 
 std::atomic<bool> alloc_fail{false};
 
+constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+//! one reserved region divided into equal stack slots
+struct arena {
+    char *base = nullptr;
+    size_t slot_size = 0;
+    size_t nslots = 0;
+    //! slots handed out at least once, the rest are untouched
+    std::atomic<size_t> carved{0};
+    std::mutex mtx;
+    //! returned slots, their pages already given back to the kernel
+    std::vector<size_t> free_slots;
+
+    bool contains(void *p) const {
+        return p >= base && p < base + slot_size * nslots;
+    }
+};
+
+std::atomic<arena *> arena_{nullptr};
+#ifdef MADV_GUARD_INSTALL
+//! cleared if this kernel doesn't have MADV_GUARD_INSTALL
+std::atomic<bool> guard_install{true};
+#endif
+
+void *arena_allocate(arena *a, size_t stack_size) {
+    if (stack_size != a->slot_size) return nullptr;
+    {
+        std::lock_guard<std::mutex> lock(a->mtx);
+        if (!a->free_slots.empty()) {
+            const size_t slot = a->free_slots.back();
+            a->free_slots.pop_back();
+            return a->base + slot * a->slot_size;
+        }
+    }
+    const size_t slot = a->carved.fetch_add(1);
+    if (slot >= a->nslots) return nullptr;
+    char *p = a->base + slot * a->slot_size;
+#ifdef MADV_GUARD_INSTALL
+    // guard regions don't split the mapping like mprotect does
+    if (guard_install.load(std::memory_order_relaxed)) {
+        if (madvise(p, page_size, MADV_GUARD_INSTALL) == 0) return p;
+        // EINVAL from older kernels that don't know the advice
+        if (errno == EINVAL) guard_install.store(false);
+    }
+#endif
+    if (mprotect(p, page_size, PROT_NONE) == -1) {
+        std::lock_guard<std::mutex> lock(a->mtx);
+        a->free_slots.push_back(slot);
+        return nullptr;
+    }
+    return p;
+}
+
+void arena_deallocate(arena *a, void *ptr) {
+    // the guard page stays, only give back what the task touched
+    PCHECK(madvise(static_cast<char *>(ptr) + page_size,
+                a->slot_size - page_size, MADV_DONTNEED) == 0);
+    const size_t slot = (static_cast<char *>(ptr) - a->base) / a->slot_size;
+    std::lock_guard<std::mutex> lock(a->mtx);
+    a->free_slots.push_back(slot);
+}
+
 inline void free_stack(void *ptr, size_t stack_size) {
+    arena *a = arena_.load(std::memory_order_acquire);
+    if (a && a->contains(ptr)) {
+        arena_deallocate(a, ptr);
+        return;
+    }
     PCHECK(munmap(ptr, stack_size) == 0);
 }
 
@@ -55,14 +126,215 @@ struct stack {
     }
 };
 
+//! cached stacks of one size
+struct bucket {
+    size_t size;
+    std::vector<stack> stacks;
+
+    explicit bucket(size_t size_) : size(size_) {}
+};
+
+//! only a few stack sizes are in use, so search them in order
+bucket &find_bucket(std::vector<bucket> &buckets, size_t size) {
+    for (auto &b : buckets) {
+        if (b.size == size) return b;
+    }
+    buckets.emplace_back(size);
+    return buckets.back();
+}
+
+//! stacks shared by all threads
+//
+//! threads spill to it when their cache passes the high watermark
+//! and refill from it when their cache is empty
+struct depot {
+    std::mutex mtx;
+    std::vector<bucket> buckets;
+};
+
+// leaked so threads exiting after static destruction can still spill
+depot &the_depot() {
+    static depot *d = new depot;
+    return *d;
+}
+
+std::atomic<uint64_t> hits{0};
+std::atomic<uint64_t> misses{0};
+std::atomic<uint64_t> refilled{0};
+std::atomic<uint64_t> spilled{0};
+
+//! how many counts a thread collects before publishing them
+constexpr uint64_t publish_every = 64;
+
+struct thread_cache {
+    std::vector<bucket> buckets;
+    // not yet added to the global counts
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t refilled = 0;
+    uint64_t spilled = 0;
+    //! tasks left until the next stack usage sample
+    uint32_t sample_countdown = 0;
+
+    thread_cache() {}
+    thread_cache(const thread_cache &) = delete;
+    thread_cache &operator = (const thread_cache &) = delete;
+
+    ~thread_cache() {
+        // give everything to threads that are still running
+        for (auto &b : buckets) {
+            spill(b, 0);
+        }
+        publish();
+    }
+
+    void publish() {
+        stack_allocator::hits.fetch_add(hits, std::memory_order_relaxed);
+        stack_allocator::misses.fetch_add(misses, std::memory_order_relaxed);
+        stack_allocator::refilled.fetch_add(refilled, std::memory_order_relaxed);
+        stack_allocator::spilled.fetch_add(spilled, std::memory_order_relaxed);
+        hits = misses = refilled = spilled = 0;
+    }
+
+    void counted() {
+        if (hits + misses >= publish_every) {
+            publish();
+        }
+    }
+
+    //! move the coldest stacks to the depot, keeping keep
+    void spill(bucket &b, size_t keep) noexcept {
+        if (b.stacks.size() <= keep) return;
+        const size_t n = b.stacks.size() - keep;
+        try {
+            depot &d = the_depot();
+            std::lock_guard<std::mutex> lock(d.mtx);
+            size_t total = 0;
+            for (const auto &db : d.buckets) {
+                total += db.stacks.size();
+            }
+            const size_t limit = depot_max.load(std::memory_order_relaxed);
+            const size_t room = total < limit ? limit - total : 0;
+            const size_t moved = std::min(n, room);
+            auto &to = find_bucket(d.buckets, b.size).stacks;
+            to.reserve(to.size() + moved);
+            std::move(begin(b.stacks), begin(b.stacks) + moved, std::back_inserter(to));
+            spilled += moved;
+        } catch (std::bad_alloc &e) {
+            // leave them here
+            return;
+        }
+        // frees the stacks that didn't fit, outside the lock
+        b.stacks.erase(begin(b.stacks), begin(b.stacks) + n);
+    }
+
+    //! take up to n stacks from the depot
+    void refill(bucket &b, size_t n) {
+        depot &d = the_depot();
+        std::lock_guard<std::mutex> lock(d.mtx);
+        auto &from = find_bucket(d.buckets, b.size).stacks;
+        n = std::min(n, from.size());
+        std::move(end(from) - n, end(from), std::back_inserter(b.stacks));
+        from.erase(end(from) - n, end(from));
+        refilled += n;
+    }
+};
+
 struct cache_tag {};
-thread_cached<cache_tag, std::vector<stack>> stack_cache;
+thread_cached<cache_tag, thread_cache> stack_cache;
 
 } // anon
 
+std::atomic<size_t> cache_low_watermark{32};
+std::atomic<size_t> cache_high_watermark{128};
+std::atomic<size_t> depot_max{1024};
+std::atomic<uint32_t> sample_every{0};
+
 // calling this function ensures all the above have been initialized
 int initialize() { return 0; }
 
+bool use_arena(size_t stack_size, size_t max_stacks, bool hugepages) {
+    CHECK(stack_size >= min_stacksize && stack_size % page_size == 0);
+    static std::mutex mtx;
+    std::lock_guard<std::mutex> lock(mtx);
+    if (arena_.load()) return false;
+
+    std::unique_ptr<arena> a{new arena};
+    a->slot_size = stack_size;
+    a->nslots = max_stacks;
+    const size_t len = stack_size * max_stacks;
+    // over reserve so the region can start on a huge page boundary
+    const size_t reserve = hugepages ? len + huge_page_size : len;
+    void *p = mmap(nullptr, reserve, PROT_READ|PROT_WRITE,
+            MAP_ANONYMOUS|MAP_PRIVATE|MAP_NORESERVE|MAP_STACK, -1, 0);
+    if (p == MAP_FAILED) {
+        PLOG(ERROR) << "reserving stack arena of " << len << " bytes";
+        return false;
+    }
+    char *base = static_cast<char *>(p);
+    if (hugepages) {
+        char *aligned = reinterpret_cast<char *>(
+                (reinterpret_cast<uintptr_t>(base) + huge_page_size - 1) & ~(huge_page_size - 1));
+        if (aligned != base) {
+            PCHECK(munmap(base, aligned - base) == 0);
+        }
+        const size_t tail = (base + reserve) - (aligned + len);
+        if (tail) {
+            PCHECK(munmap(aligned + len, tail) == 0);
+        }
+        base = aligned;
+        if (madvise(base, len, MADV_HUGEPAGE) == -1) {
+            PLOG(WARNING) << "MADV_HUGEPAGE on stack arena";
+        }
+    }
+    a->base = base;
+    arena_.store(a.release(), std::memory_order_release);
+    // never freed, stacks can outlive any owner we could give it
+    return true;
+}
+
+void set_cache_watermarks(size_t low, size_t high, size_t depot) {
+    CHECK(low <= high);
+    cache_low_watermark.store(low);
+    cache_high_watermark.store(high);
+    depot_max.store(depot);
+}
+
+kernel::stack_cache_counts stats() {
+    kernel::stack_cache_counts c;
+    c.hits = hits.load(std::memory_order_relaxed);
+    c.misses = misses.load(std::memory_order_relaxed);
+    c.refilled = refilled.load(std::memory_order_relaxed);
+    c.spilled = spilled.load(std::memory_order_relaxed);
+    c.depot_size = 0;
+    depot &d = the_depot();
+    std::lock_guard<std::mutex> lock(d.mtx);
+    for (const auto &b : d.buckets) {
+        c.depot_size += b.stacks.size();
+    }
+    return c;
+}
+
+size_t class_size(stack_class sc) {
+    switch (sc) {
+    case stack_class::small:  return 32 * 1024;
+    case stack_class::medium: return 64 * 1024;
+    case stack_class::large:  return 1024 * 1024;
+    case stack_class::normal: break;
+    }
+    return default_stacksize;
+}
+
+bool sample_next() {
+    const uint32_t every = sample_every.load(std::memory_order_relaxed);
+    if (every == 0) return false;
+    auto &cache = *stack_cache;
+    if (cache.sample_countdown == 0 || cache.sample_countdown > every) {
+        cache.sample_countdown = every;
+    }
+    return --cache.sample_countdown == 0;
+}
+
 void gc_cache(std::vector<stack> &cache) {
     // reduce cache size by 20%
     const size_t n = cache.size() / 5;
@@ -75,9 +347,23 @@ void gc_cache(std::vector<stack> &cache) {
 void *allocate(size_t stack_size) {
     // TODO: check stack_size >= min_stacksize (8k because of 4k guard page)
     auto &cache = *stack_cache;
+    auto &b = find_bucket(cache.buckets, stack_size);
+    if (b.stacks.empty()) {
+        cache.refill(b, std::max<size_t>(cache_low_watermark.load(std::memory_order_relaxed), 1));
+    }
 
     void *stack_ptr = nullptr;
-    if (cache.empty()) {
+    if (b.stacks.empty()) {
+        ++cache.misses;
+        arena *a = arena_.load(std::memory_order_acquire);
+        if (a) {
+            stack_ptr = arena_allocate(a, stack_size);
+        }
+    }
+    if (stack_ptr) {
+        // carved out of the arena
+    } else if (b.stacks.empty()) {
+        // no arena, it is full, or this is not its stack size
         stack_ptr = mmap(nullptr, stack_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE|MAP_STACK, 0, 0);
         if (stack_ptr == MAP_FAILED) {
             alloc_fail.store(true);
@@ -89,14 +375,14 @@ void *allocate(size_t stack_size) {
             throw bad_stack_alloc();
         }
     } else {
-        auto &reuse = cache.back();
-        CHECK(reuse.size == stack_size);
-        stack_ptr = reuse.release();
-        cache.pop_back();
-        if (!cache.empty() && alloc_fail.exchange(false)) {
-            gc_cache(cache);
+        ++cache.hits;
+        stack_ptr = b.stacks.back().release();
+        b.stacks.pop_back();
+        if (!b.stacks.empty() && alloc_fail.exchange(false)) {
+            gc_cache(b.stacks);
         }
     }
+    cache.counted();
     return static_cast<char *>(stack_ptr) + stack_size;
 }
 
@@ -104,11 +390,15 @@ void deallocate(void *stack_end, size_t stack_size) noexcept {
     void *stack_ptr = static_cast<char *>(stack_end) - stack_size;
     auto &cache = *stack_cache;
     try {
-        if (!cache.empty() && alloc_fail.exchange(false)) {
+        auto &b = find_bucket(cache.buckets, stack_size);
+        if (!b.stacks.empty() && alloc_fail.exchange(false)) {
             free_stack(stack_ptr, stack_size);
-            gc_cache(cache);
+            gc_cache(b.stacks);
         } else {
-            cache.emplace_back(stack_ptr, stack_size);
+            b.stacks.emplace_back(stack_ptr, stack_size);
+            if (b.stacks.size() > cache_high_watermark.load(std::memory_order_relaxed)) {
+                cache.spill(b, cache_low_watermark.load(std::memory_order_relaxed));
+            }
         }
     } catch (std::bad_alloc &e) {
         free_stack(stack_ptr, stack_size);
@@ -1,6 +1,7 @@
 #ifndef LIBTEN_TASK_STACK_ALLOC_HH_
 #define LIBTEN_TASK_STACK_ALLOC_HH_
 
+#include "ten/task/task.hh"
 #include <memory>
 #include <atomic>
 
@@ -18,8 +19,34 @@ namespace stack_allocator {
 
     extern size_t default_stacksize;
 
+    //! per thread caches spill down to the low watermark when they grow
+    //! past the high one, and refill up to the low one when empty
+    extern std::atomic<size_t> cache_low_watermark;
+    extern std::atomic<size_t> cache_high_watermark;
+    //! most stacks kept in the shared depot, the rest are freed
+    extern std::atomic<size_t> depot_max;
+
+    void set_cache_watermarks(size_t low, size_t high, size_t depot);
+    kernel::stack_cache_counts stats();
+
+    //! bytes of stack for tasks spawned with sc
+    size_t class_size(stack_class sc);
+
+    //! sample the stack usage of one in every sample_every tasks, 0 for none
+    extern std::atomic<uint32_t> sample_every;
+    //! should this thread's next task be sampled
+    bool sample_next();
+
     int initialize();
 
+    //! carve stacks of stack_size out of one region reserved for max_stacks
+    //
+    //! the region is lazily committed and released with MADV_DONTNEED,
+    //! so it costs one mapping instead of one or two per stack.
+    //! hugepages asks for transparent huge pages on the region.
+    //! \return false if an arena is already in use
+    bool use_arena(size_t stack_size, size_t max_stacks, bool hugepages);
+
     void *allocate(size_t stack_size);
     void deallocate(void *stack_end, size_t stack_size) noexcept;
 };
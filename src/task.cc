@@ -1,19 +1,71 @@
 #include "thread_context.hh"
+#include "ten/metrics.hh"
 #include <stdexcept>
+#include <mutex>
+#include <unordered_map>
 #include <inttypes.h>
 
 namespace ten {
 
 namespace {
 std::atomic<uint64_t> taskidgen(0);
+
+//! deepest stack seen for each name group by any thread
+std::mutex stack_max_mutex;
+std::unordered_map<std::string, size_t> stack_max;
+
+//! add a stack usage sample to this thread's metrics
+//
+//! tasks are grouped by task_group. fits counts the smallest
+//! stack_class that would have held the stack. max is a gauge
+//! raised by this thread by however much it beat the deepest
+//! sample so far, so the sum over threads is the process max.
+void record_stack_usage(const char *name, size_t used) {
+    static const std::pair<stack_class, const char *> classes[] = {
+        {stack_class::small, "small"},
+        {stack_class::medium, "medium"},
+        {stack_class::normal, "normal"},
+        {stack_class::large, "large"},
+    };
+    const char *fits = nullptr;
+    size_t fits_size = 0;
+    for (const auto &c : classes) {
+        const size_t usable = stack_allocator::class_size(c.first) - stack_allocator::page_size;
+        if (usable >= used && (!fits || usable < fits_size)) {
+            fits = c.second;
+            fits_size = usable;
+        }
+    }
+    const std::string group = task_group(name);
+    auto m = metrics::record();
+    m.counter("stack", group, "samples").incr();
+    m.counter("stack", group, "used").incr(used);
+    m.counter("stack", group, "fits", fits ? fits : "none").incr();
+    size_t raised = 0;
+    {
+        std::lock_guard<std::mutex> lock(stack_max_mutex);
+        size_t &max = stack_max[group];
+        if (used > max) {
+            raised = used - max;
+            max = used;
+        }
+    }
+    if (raised) m.gauge("stack", group, "max").incr(raised);
 }
 
+} // anon
+
 std::ostream &operator << (std::ostream &o, ptr<task::impl> t) {
     if (t) {
         o << "[" << (void*)t.get() << " " << t->get_id() << " "
           << t->getname() << " |" << t->getstate()
           << "| canceled: " << t->_canceled
-          << " ready: " << t->_ready << "]";
+          << " ready: " << t->_ready;
+        if (t->_profile) {
+            o << " cpu: " << task_profiler::to_ns(t->_profile->total_run) / 1000 << "us"
+              << " switches: " << t->_profile->total_switches;
+        }
+        o << "]";
     } else {
         o << "nulltask";
     }
@@ -31,6 +83,14 @@ void yield() {
     t->yield();
 }
 
+void set_priority(task_priority p) {
+    scheduler::current_task()->set_priority(p);
+}
+
+task_priority priority() {
+    return scheduler::current_task()->priority();
+}
+
 void sleep_until(const kernel::time_point& sleep_time) {
     task::impl::cancellation_point cancellable;
     const auto t = scheduler::current_task();
@@ -41,12 +101,18 @@ void sleep_until(const kernel::time_point& sleep_time) {
 } // this_task
 
 
-task::task(std::function<void ()> f)
-    : _impl{std::make_shared<task::impl>(std::move(f), stack_allocator::default_stacksize)}
+task::task(std::function<void ()> f, bool pinned, stack_class sc)
+    : _impl{std::make_shared<task::impl>(std::move(f),
+            stack_allocator::class_size(sc), stack_allocator::sample_next())}
 {
-    this_ctx->scheduler.attach_task(_impl);
-    // add new tasks to front of runqueue
-    _impl->ready(true);
+    auto &sched = this_ctx->scheduler;
+    if (!pinned && sched.work_stealing()) {
+        sched.attach_stealable_task(_impl);
+    } else {
+        sched.attach_task(_impl);
+        // add new tasks to front of runqueue
+        _impl->ready(true);
+    }
 }
 
 uint64_t task::get_id() const {
@@ -82,20 +148,23 @@ task::impl::impl()
     _id{++taskidgen},
     _fn{},
     _ready{false},
-    _canceled{false}
+    _canceled{false},
+    _on_cpu{true}
 {
     setname("main[%" PRId64 "]", _id);
     setstate("new");
 }
 
-task::impl::impl(std::function<void ()> f, size_t stacksize)
-    : _ctx{task::impl::trampoline, stacksize},
+task::impl::impl(std::function<void ()> f, size_t stacksize, bool sample_stack)
+    : _ctx{task::impl::trampoline, stacksize, sample_stack},
     _cancel_points{0},
     _aux{new auxinfo{}},
     _id{++taskidgen},
     _fn{std::move(f)},
     _ready{false},
-    _canceled{false}
+    _canceled{false},
+    _on_cpu{false},
+    _stack_sampled{sample_stack}
 {
     setname("task[%" PRId64 "]", _id);
     setstate("new");
@@ -107,6 +176,10 @@ void task::impl::trampoline(intptr_t arg) {
         task::entry(t->_fn);
     }
     t->_fn = nullptr;
+    if (t->_stack_sampled) {
+        record_stack_usage(t->getname(), t->_ctx.stack_used());
+    }
+    t->flush_profile();
     t->_join([](joininfo &i){
         DCHECK(!i.finished);
         i.finished = true;
@@ -115,7 +188,7 @@ void task::impl::trampoline(intptr_t arg) {
             i.joiner = nullptr;
         }
     });
-    const auto sched = t->_scheduler;
+    scheduler *sched = t->_scheduler.load(std::memory_order_relaxed);
     sched->remove_task(t);
     sched->schedule();
     // never get here
@@ -168,18 +241,28 @@ void task::impl::vsetstate(const char *fmt, va_list arg) {
 void task::impl::yield() {
     task::impl::cancellation_point cancellable;
     if (_ready.exchange(true) == false) {
+        mark_ready();
         setstate("yield");
-        _scheduler->unsafe_ready(ptr<task::impl>{this});
+        owner()->unsafe_ready(ptr<task::impl>{this});
     }
     swap();
 }
 
+void task::impl::flush_profile() {
+    if (_profile) {
+        const uint64_t now = task_profiler::ticks();
+        _profile->switched_out(now);
+        _profile->flush(getname());
+        _profile->resumed = now;
+    }
+}
+
 void task::impl::safe_swap() noexcept {
-    _scheduler->schedule();
+    owner()->schedule();
 }
 
 void task::impl::swap() {
-    _scheduler->schedule();
+    owner()->schedule();
     //ctx.swap(this_ctx->scheduler.sched_context(), 0);
 
     if (_canceled && _cancel_points > 0) {
@@ -223,12 +306,12 @@ void task::impl::join() noexcept {
 }
 
 void task::impl::ready(bool front) {
-    _scheduler->ready(ptr<task::impl>{this}, front);
+    scheduler::ready(ptr<task::impl>{this}, front);
 }
 
 
 void task::impl::ready_for_io() {
-    _scheduler->ready_for_io(ptr<task::impl>{this});
+    owner()->ready_for_io(ptr<task::impl>{this});
 }
 
 task::impl::cancellation_point::cancellation_point() {
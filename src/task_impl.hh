@@ -4,6 +4,8 @@
 #include <memory>
 #include <thread>
 #include <atomic>
+#include <string>
+#include <cstring>
 
 #include "ten/task.hh"
 #include "ten/logging.hh"
@@ -11,6 +13,7 @@
 #include "ten/ptr.hh"
 #include "ten/synchronized.hh"
 #include "context.hh"
+#include "task_profile.hh"
 
 using namespace std::chrono;
 
@@ -20,8 +23,15 @@ class scheduler;
 
 void taskdumpf(FILE *of = stderr);
 
+//! metrics group tasks by name up to the first '[', so every
+//! "task[id]" counts as "task"
+inline std::string task_group(const char *name) {
+    return std::string(name, strcspn(name, "["));
+}
+
 class task::impl {
     friend class scheduler;
+    friend class task_pool;
     friend std::ostream &operator << (std::ostream &o, ptr<task::impl> t);
 private:
     static constexpr size_t namesize = 16;
@@ -35,7 +45,8 @@ private:
     // order is important here
     // to get most used in the first cache line
     context _ctx;
-    ptr<scheduler> _scheduler;
+    //! changes when a thief adopts the task, see scheduler::ready
+    std::atomic<scheduler *> _scheduler{nullptr};
     std::exception_ptr _exception;
     uint64_t _cancel_points;
     struct auxinfo { char name[namesize]; char state[statesize]; };
@@ -47,14 +58,33 @@ private:
     std::function<void ()> _fn;
     std::atomic<bool> _ready;
     std::atomic<bool> _canceled;
+    //! running on its thread right now, see qutex::lock
+    std::atomic<bool> _on_cpu;
     struct joininfo {
         bool finished = false;
         ptr<task::impl> joiner;
     };
     synchronized<joininfo> _join;
+    //! keeps the task alive while it sits in a work stealing queue,
+    //! or in a ready queue after it exited
+    std::shared_ptr<task::impl> _self;
+    //! link in another thread's scheduler::_dirtyq
+    task::impl *_dirty_next = nullptr;
+    //! position in scheduler::_user_tasks
+    size_t _task_index = 0;
+    //! finished but still in a ready queue, see scheduler::remove_task
+    bool _exited = false;
+    //! which run_queue level the task goes in
+    task_priority _priority = task_priority::normal;
+    //! stack was painted, record how much was used on exit
+    const bool _stack_sampled = false;
+    //! task_profiler::ticks() when last readied, 0 when not profiling
+    uint64_t _ready_at = 0;
+    //! allocated the first time the task runs while profiling
+    std::unique_ptr<task_profile> _profile;
 public:
     impl();
-    impl(std::function<void ()> f, size_t stacksize);
+    impl(std::function<void ()> f, size_t stacksize, bool sample_stack=false);
 
     void setname(const char *fmt, ...) __attribute__((format (printf, 2, 3)));
     void vsetname(const char *fmt, va_list arg);
@@ -77,6 +107,21 @@ public:
 
     uint64_t get_id() const { return _id; }
 
+    //! the scheduler running this task, only from the task's own thread
+    scheduler *owner() const { return _scheduler.load(std::memory_order_relaxed); }
+
+    task_priority priority() const { return _priority; }
+    void set_priority(task_priority p) { _priority = p; }
+
+    bool on_cpu() const { return _on_cpu.load(std::memory_order_relaxed); }
+
+    //! stamp the time the task became ready, if profiling
+    void mark_ready() {
+        _ready_at = task_profiler::on() ? task_profiler::ticks() : 0;
+    }
+    //! publish the profile under the current name, ends the running slice
+    void flush_profile();
+
     void join() noexcept;
 private:
     static void trampoline(intptr_t arg);
@@ -0,0 +1,113 @@
+#include "ten/task/task_pool.hh"
+#include "thread_context.hh"
+#include <algorithm>
+#include <inttypes.h>
+
+namespace ten {
+
+struct task_pool::worker {
+    ptr<task::impl> t;
+    std::function<void ()> job;
+
+    explicit worker(ptr<task::impl> t_) : t(t_) {}
+};
+
+struct task_pool::state {
+    //! parked workers, most recently used last so its stack is warm
+    std::vector<worker *> idle;
+    size_t max_idle;
+    stack_class sc;
+    bool closing = false;
+    uint64_t spawned = 0;
+    uint64_t reused = 0;
+    //! the thread's scheduler, only for checking
+    const ptr<scheduler> sched;
+
+    state(size_t max_idle_, stack_class sc_)
+        : max_idle(max_idle_), sc(sc_), sched(&this_ctx->scheduler) {}
+
+    void run(std::function<void ()> first);
+};
+
+void task_pool::state::run(std::function<void ()> first) {
+    const auto t = scheduler::current_task();
+    worker w{t};
+    w.job = std::move(first);
+    for (;;) {
+        task::entry(std::move(w.job));
+        w.job = nullptr;
+        // interrupted for good, or a deadline fired after the closure was done
+        if (t->_canceled) return;
+        // charge the job's time to its own name
+        t->flush_profile();
+        t->_exception = nullptr;
+        t->setname("task[%" PRId64 "]", t->get_id());
+        t->set_priority(task_priority::normal);
+        t->setstate("idle");
+        if (closing || idle.size() >= max_idle) return;
+        idle.push_back(&w);
+        try {
+            task::impl::cancellation_point cancellable;
+            // loop to handle spurious wakeups
+            while (!w.job && !closing) {
+                t->swap();
+            }
+        } catch (task_interrupted &) {
+            auto i = std::find(idle.begin(), idle.end(), &w);
+            if (i != idle.end()) idle.erase(i);
+            return;
+        }
+        if (!w.job) return;
+    }
+}
+
+task_pool::task_pool(size_t max_idle, stack_class sc)
+    : _state{std::make_shared<state>(max_idle, sc)}
+{
+}
+
+task_pool::~task_pool() {
+    _state->closing = true;
+    for (worker *w : _state->idle) {
+        w->t->ready();
+    }
+    _state->idle.clear();
+}
+
+void task_pool::spawn(std::function<void ()> f) {
+    DCHECK(_state->sched.get() == &this_ctx->scheduler)
+        << "BUG: task_pool used from another thread";
+    if (!_state->idle.empty()) {
+        worker *w = _state->idle.back();
+        _state->idle.pop_back();
+        w->job = std::move(f);
+        ++_state->reused;
+        // like task::spawn, run before other ready tasks
+        w->t->ready(true);
+        return;
+    }
+    ++_state->spawned;
+    if (_state->max_idle == 0) {
+        // nothing will be parked, so it may as well be stealable
+        task::spawn(std::move(f), _state->sc);
+        return;
+    }
+    auto st = _state;
+    task::spawn_pinned([st, f]() mutable {
+        st->run(std::move(f));
+    }, _state->sc);
+}
+
+size_t task_pool::idle() const {
+    return _state->idle.size();
+}
+
+uint64_t task_pool::spawned() const {
+    return _state->spawned;
+}
+
+uint64_t task_pool::reused() const {
+    return _state->reused;
+}
+
+} // ten
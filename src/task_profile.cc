@@ -0,0 +1,90 @@
+#include "task_profile.hh"
+#include "task_impl.hh"
+#include "ten/metrics.hh"
+#include <mutex>
+#include <thread>
+
+namespace ten {
+
+namespace task_profiler {
+    std::atomic<bool> enabled{false};
+    std::atomic<double> tick_ns{1.0};
+
+    namespace {
+        std::once_flag calibrated;
+
+        void calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+            using namespace std::chrono;
+            const auto start = steady_clock::now();
+            const uint64_t t0 = ticks();
+            std::this_thread::sleep_for(milliseconds{5});
+            const uint64_t t1 = ticks();
+            const auto ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+            if (t1 > t0) {
+                tick_ns.store(static_cast<double>(ns) / (t1 - t0));
+            }
+#endif
+        }
+
+        size_t bucket(uint64_t ns) {
+            size_t b = 0;
+            for (uint64_t limit = 10000; b < nbuckets - 1 && ns >= limit; limit *= 10) {
+                ++b;
+            }
+            return b;
+        }
+
+        const char *bucket_names[nbuckets] = {
+            "lt_10us", "lt_100us", "lt_1ms", "lt_10ms", "ge_10ms"
+        };
+    } // anon
+
+    void enable(bool on) {
+        if (on) {
+            std::call_once(calibrated, calibrate);
+        }
+        enabled.store(on);
+    }
+} // task_profiler
+
+using namespace task_profiler;
+
+void task_profile::switched_in(uint64_t ready_at, uint64_t now) {
+    if (ready_at && now > ready_at) {
+        wait += now - ready_at;
+        ++waits[bucket(to_ns(now - ready_at))];
+    }
+    resumed = now;
+    ++switches;
+    ++total_switches;
+}
+
+void task_profile::switched_out(uint64_t now) {
+    if (resumed && now > resumed) {
+        run += now - resumed;
+        total_run += now - resumed;
+        ++slices[bucket(to_ns(now - resumed))];
+    }
+    resumed = 0;
+}
+
+void task_profile::flush(const char *name) {
+    if (switches == 0) return;
+    using std::chrono::nanoseconds;
+    const std::string group = task_group(name);
+    auto m = metrics::record();
+    m.counter("task", group, "switches").incr(switches);
+    m.timer("task", group, "run").update(nanoseconds{to_ns(run)});
+    m.timer("task", group, "wait").update(nanoseconds{to_ns(wait)});
+    for (size_t i=0; i<nbuckets; ++i) {
+        if (slices[i]) m.counter("task", group, "slices", bucket_names[i]).incr(slices[i]);
+        if (waits[i]) m.counter("task", group, "waits", bucket_names[i]).incr(waits[i]);
+    }
+    run = wait = 0;
+    switches = 0;
+    std::fill(std::begin(slices), std::end(slices), 0);
+    std::fill(std::begin(waits), std::end(waits), 0);
+}
+
+} // ten
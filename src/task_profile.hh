@@ -0,0 +1,73 @@
+#ifndef LIBTEN_TASK_PROFILE_HH_
+#define LIBTEN_TASK_PROFILE_HH_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace ten {
+
+namespace task_profiler {
+    //! see kernel::set_task_profiling
+    extern std::atomic<bool> enabled;
+    //! nanoseconds per tick, calibrated when profiling is first enabled
+    extern std::atomic<double> tick_ns;
+
+    //! switches between publishing a task's numbers to ten::metrics
+    constexpr uint32_t flush_every = 256;
+
+    //! latency buckets: <10us, <100us, <1ms, <10ms and the rest
+    constexpr size_t nbuckets = 5;
+
+    inline bool on() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    //! cheap timestamp, the tsc where there is one
+    inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    inline uint64_t to_ns(uint64_t t) {
+        return static_cast<uint64_t>(t * tick_ns.load(std::memory_order_relaxed));
+    }
+
+    //! measure tick_ns once and turn profiling on or off
+    void enable(bool on);
+} // task_profiler
+
+//! where a task spends its time, kept by the scheduler while profiling
+struct task_profile {
+    //! when the current slice started, 0 when not running
+    uint64_t resumed = 0;
+    //! since the last flush, in ticks
+    uint64_t run = 0;
+    uint64_t wait = 0;
+    uint32_t switches = 0;
+    uint32_t slices[task_profiler::nbuckets] = {};
+    uint32_t waits[task_profiler::nbuckets] = {};
+    //! for the lifetime of the task
+    uint64_t total_run = 0;
+    uint64_t total_switches = 0;
+
+    //! the task starts a slice after ready_at, 0 if it was readied
+    //! before profiling was turned on
+    void switched_in(uint64_t ready_at, uint64_t now);
+    //! the task stops running
+    void switched_out(uint64_t now);
+    //! add what was collected since the last flush to ten::metrics,
+    //! grouped by the task name up to the first '['
+    void flush(const char *name);
+};
+
+} // ten
+
+#endif
@@ -17,8 +17,92 @@ namespace {
 
     using tvec_t = std::vector<ptr<thread_context>>;
     static synchronized<tvec_t> threads;
+    //! held by the watchdog while it looks at a snapshot of threads,
+    //! ~thread_context waits on it so the snapshot can't dangle
+    std::mutex watching;
 
     int dummy = stack_allocator::initialize();
+
+    void watchdog_handler(int, siginfo_t *, void *ucontext) {
+        const int saved_errno = errno;
+        if (this_ctx) {
+            this_ctx->scheduler.capture_stall(ucontext);
+        }
+        errno = saved_errno;
+    }
+
+    //! one thread watching every scheduler
+    struct watchdog_t {
+        std::mutex set_mutex;
+        std::mutex mutex;
+        std::condition_variable cv;
+        kernel::duration stall{};
+        std::thread thread;
+
+        void run() {
+            std::unique_lock<std::mutex> lk{mutex};
+            while (stall != kernel::duration::zero()) {
+                const auto limit = stall;
+                lk.unlock();
+                {
+                    // watch() signals and waits, so don't hold up
+                    // threads starting and exiting meanwhile
+                    std::lock_guard<std::mutex> wl{watching};
+                    const tvec_t tvec = threads([](const tvec_t &tv) {
+                        return tv;
+                    });
+                    const auto now = kernel::clock::now();
+                    for (auto &ctx : tvec) {
+                        ctx->scheduler.watch(now, limit);
+                    }
+                }
+                lk.lock();
+                // look often enough to catch a stall soon after limit
+                cv.wait_for(lk, limit / 4);
+            }
+        }
+
+        //! signal the handler is installed for, 0 for none yet
+        int installed = 0;
+
+        void set(kernel::duration d, int signo) {
+            std::lock_guard<std::mutex> set_lk{set_mutex};
+            {
+                std::lock_guard<std::mutex> lk{mutex};
+                stall = kernel::duration::zero();
+            }
+            cv.notify_one();
+            if (thread.joinable()) {
+                thread.join();
+            }
+            if (d == kernel::duration::zero()) return;
+            if (signo != installed) {
+                if (!installed) {
+                    // the first backtrace() loads libgcc and allocates,
+                    // which must not happen in the handler
+                    saved_backtrace warm;
+                    (void)warm;
+                }
+                // a handler left on an earlier signal ignores it unarmed
+                struct sigaction act;
+                memset(&act, 0, sizeof(act));
+                act.sa_sigaction = watchdog_handler;
+                act.sa_flags = SA_RESTART | SA_ONSTACK | SA_SIGINFO;
+                throw_if(sigaction(signo, &act, nullptr) == -1);
+                installed = signo;
+            }
+            scheduler::watchdog_signal.store(signo);
+            {
+                std::lock_guard<std::mutex> lk{mutex};
+                stall = d;
+            }
+            thread = std::thread{&watchdog_t::run, this};
+        }
+    } watchdog;
+
+    void stop_watchdog() {
+        watchdog.set(kernel::duration::zero(), 0);
+    }
 } // anon namespace
 
 inotify_fd resolv_conf_watch_fd{IN_NONBLOCK};
@@ -43,6 +127,8 @@ thread_context::~thread_context() {
             LOG(FATAL) << "BUG: thread " << (void*)me.get() << " escaped the thread list";
         tvec.erase(i);
     });
+    // let a watchdog pass that saw us finish
+    std::lock_guard<std::mutex> wl{watching};
     this_ctx = nullptr;
 }
 
@@ -60,6 +146,14 @@ void thread_context::cancel_all() {
     });
 }
 
+void thread_context::set_watchdog(kernel::duration stall, int signo) {
+    // registered after the metrics globals were constructed, so the
+    // thread and its metrics are gone before they are destroyed
+    static std::once_flag registered;
+    std::call_once(registered, [] { std::atexit(stop_watchdog); });
+    watchdog.set(stall, signo);
+}
+
 void thread_context::dump_all() {
     threads([](const tvec_t &tvec) {
         for (auto &ctx : tvec) {
@@ -27,6 +27,9 @@ struct thread_context {
 
     static void dump_all();
     static size_t count();
+
+    //! see kernel::set_watchdog
+    static void set_watchdog(kernel::duration stall, int signo);
 };
 
 extern __thread thread_context *this_ctx;
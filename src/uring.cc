@@ -0,0 +1,114 @@
+#include "uring.hh"
+#include "ten/error.hh"
+#include "ten/logging.hh"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+
+namespace ten {
+
+static int io_uring_setup(unsigned entries, io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, offset);
+    throw_if(p == MAP_FAILED);
+    return p;
+}
+
+bool uring::supported() {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = io_uring_setup(2, &p);
+    if (fd == -1) return false;
+    ::close(fd);
+    // need NODROP so a full completion ring can't lose wakeups
+    return p.features & IORING_FEAT_NODROP;
+}
+
+uring::uring(unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    _fd = io_uring_setup(entries, &p);
+    throw_if(_fd == -1);
+    _features = p.features;
+
+    _sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (_features & IORING_FEAT_SINGLE_MMAP) {
+        _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+    }
+    _sq_ring = map_ring(_fd, _sq_ring_size, IORING_OFF_SQ_RING);
+    if (_features & IORING_FEAT_SINGLE_MMAP) {
+        _cq_ring = _sq_ring;
+    } else {
+        _cq_ring = map_ring(_fd, _cq_ring_size, IORING_OFF_CQ_RING);
+    }
+    _sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    _sqes = static_cast<io_uring_sqe *>(map_ring(_fd, _sqes_size, IORING_OFF_SQES));
+
+    char *sq = static_cast<char *>(_sq_ring);
+    _sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    _sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    _sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    _sq_entries = p.sq_entries;
+    _sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+
+    char *cq = static_cast<char *>(_cq_ring);
+    _cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    _cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    _cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    _cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+}
+
+uring::~uring() {
+    if (_sqes) munmap(_sqes, _sqes_size);
+    if (_cq_ring && _cq_ring != _sq_ring) munmap(_cq_ring, _cq_ring_size);
+    if (_sq_ring) munmap(_sq_ring, _sq_ring_size);
+    if (_fd != -1) ::close(_fd);
+}
+
+io_uring_sqe *uring::get_sqe() {
+    const unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    if (_sqe_tail - head >= _sq_entries) {
+        // ring is full of sqes the kernel hasn't consumed yet
+        submit();
+        CHECK(_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) < _sq_entries)
+            << "io_uring submission ring stuck full";
+    }
+    io_uring_sqe *sqe = &_sqes[_sqe_tail & _sq_mask];
+    ++_sqe_tail;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void uring::flush_sq() {
+    unsigned tail = *_sq_tail;
+    for (; _sqe_head != _sqe_tail; ++_sqe_head, ++tail) {
+        _sq_array[tail & _sq_mask] = _sqe_head & _sq_mask;
+    }
+    __atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+void uring::submit(unsigned min_complete) {
+    flush_sq();
+    // includes sqes left over if the last enter was interrupted
+    const unsigned to_submit = *_sq_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    const unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    if (to_submit == 0 && min_complete == 0) return;
+    int s = io_uring_enter(_fd, to_submit, min_complete, flags);
+    // interrupted by a signal or the completion ring is backed up,
+    // either way the caller reaps and whatever is left goes next time
+    if (s == -1 && (errno == EINTR || errno == EBUSY || errno == EAGAIN)) return;
+    PCHECK(s >= 0) << "io_uring_enter failed";
+}
+
+} // ten
@@ -0,0 +1,78 @@
+#ifndef LIBTEN_URING_HH
+#define LIBTEN_URING_HH
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace ten {
+
+//! minimal io_uring submission/completion rings
+//
+//! talks to the kernel with the raw syscalls so we don't depend on liburing.
+//! one per thread, not thread safe.
+class uring {
+private:
+    int _fd = -1;
+    unsigned _features = 0;
+
+    void *_sq_ring = nullptr;
+    size_t _sq_ring_size = 0;
+    void *_cq_ring = nullptr;
+    size_t _cq_ring_size = 0;
+    io_uring_sqe *_sqes = nullptr;
+    size_t _sqes_size = 0;
+
+    unsigned *_sq_head = nullptr;
+    unsigned *_sq_tail = nullptr;
+    unsigned _sq_mask = 0;
+    unsigned _sq_entries = 0;
+    unsigned *_sq_array = nullptr;
+
+    unsigned *_cq_head = nullptr;
+    unsigned *_cq_tail = nullptr;
+    unsigned _cq_mask = 0;
+    io_uring_cqe *_cqes = nullptr;
+
+    //! sqes handed out but not yet given to the kernel
+    unsigned _sqe_head = 0;
+    unsigned _sqe_tail = 0;
+
+    void flush_sq();
+public:
+    explicit uring(unsigned entries);
+    ~uring();
+
+    uring(const uring &) = delete;
+    uring &operator = (const uring &) = delete;
+
+    //! true if this kernel lets us create a ring
+    static bool supported();
+
+    //! next free sqe, zeroed. submits to make room if the ring is full
+    io_uring_sqe *get_sqe();
+
+    //! number of sqes waiting for submit()
+    unsigned pending() const { return _sqe_tail - _sqe_head; }
+
+    //! give pending sqes to the kernel, waiting for min_complete completions
+    void submit(unsigned min_complete=0);
+
+    //! call f(user_data, res) for each completion, returns the count
+    template <class Function>
+    unsigned reap(Function f) {
+        unsigned head = *_cq_head;
+        const unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+        for (; head != tail; ++head, ++n) {
+            const io_uring_cqe &cqe = _cqes[head & _cq_mask];
+            f(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        return n;
+    }
+};
+
+} // ten
+
+#endif // LIBTEN_URING_HH
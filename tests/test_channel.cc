@@ -212,3 +212,359 @@ TEST(Channel, Close) {
     EXPECT_EQ(closed, 3);
 }
 
+
+void ring_test_task() {
+    typedef channel<std::unique_ptr<int>, ring<4>> ring_channel;
+    ring_channel c;
+    channel<int> done_chan;
+    // fills the ring so the sender parks until we recv
+    task::spawn([=] {
+        ring_channel rc = c;
+        channel<int> done = done_chan;
+        for (int i=0; i<10; ++i) {
+            rc.send(std::unique_ptr<int>(new int(i)));
+        }
+        done.send(1);
+    });
+    for (int i=0; i<10; ++i) {
+        EXPECT_EQ(i, *c.recv());
+    }
+    done_chan.recv();
+    EXPECT_TRUE(c.empty());
+
+    c.send(std::unique_ptr<int>(new int(42)));
+    c.close();
+    EXPECT_THROW(c.send(std::unique_ptr<int>(new int(43))), channel_closed_error);
+    // buffered items are still delivered after close
+    EXPECT_EQ(42, *c.recv());
+    EXPECT_THROW(c.recv(), channel_closed_error);
+}
+
+TEST(Channel, Ring) {
+    task::main([] {
+        task::spawn(ring_test_task);
+    });
+}
+
+void ring_threaded_task() {
+    typedef channel<uint64_t, ring<64>> ring_channel;
+    const int nthreads = 4;
+    const uint64_t per_thread = 100000;
+    ring_channel c;
+    channel<uint64_t> sums{nthreads};
+    std::vector<std::thread> threads;
+    for (int n=0; n<nthreads; ++n) {
+        threads.emplace_back(task::spawn_thread([=] {
+            ring_channel rc = c;
+            for (uint64_t i=1; i<=per_thread; ++i) {
+                uint64_t v = i;
+                rc.send(std::move(v));
+            }
+        }));
+        threads.emplace_back(task::spawn_thread([=] {
+            ring_channel rc = c;
+            channel<uint64_t> s = sums;
+            uint64_t sum = 0;
+            for (uint64_t i=0; i<per_thread; ++i) {
+                sum += rc.recv();
+            }
+            s.send(std::move(sum));
+        }));
+    }
+    uint64_t total = 0;
+    for (int n=0; n<nthreads; ++n) {
+        total += sums.recv();
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(nthreads * (per_thread * (per_thread + 1) / 2), total);
+    EXPECT_TRUE(c.empty());
+}
+
+TEST(Channel, RingThreaded) {
+    task::main([] {
+        task::spawn(ring_threaded_task);
+    });
+}
+
+static void select_test_task() {
+    channel<int> a{1};
+    channel<int> b;
+    int ai = 0, bi = 0;
+
+    // nothing ready, times out
+    EXPECT_FALSE(select_for(std::chrono::milliseconds{5}, a.recv_case(ai), b.recv_case(bi)));
+    EXPECT_FALSE(a.timed_recv(ai, std::chrono::milliseconds{1}));
+
+    // ready case completes without waiting
+    a.send(1);
+    EXPECT_EQ(0u, select(a.recv_case(ai), b.recv_case(bi)));
+    EXPECT_EQ(1, ai);
+
+    // first listed wins when both are ready
+    channel<int> c{1};
+    a.send(2);
+    c.send(3);
+    EXPECT_EQ(1u, select(b.recv_case(bi), c.recv_case(ai), a.recv_case(ai)));
+    EXPECT_EQ(3, ai);
+    EXPECT_EQ(2, a.recv());
+
+    // wake up for an unbuffered sender on the second channel
+    task::spawn([=] {
+        channel<int> bb = b;
+        this_task::sleep_for(std::chrono::milliseconds{5});
+        bb.send(4);
+    });
+    EXPECT_EQ(1u, select(a.recv_case(ai), b.recv_case(bi)));
+    EXPECT_EQ(4, bi);
+
+    // send case waits for room
+    a.send(5);
+    task::spawn([=] {
+        channel<int> aa = a;
+        this_task::sleep_for(std::chrono::milliseconds{5});
+        EXPECT_EQ(5, aa.recv());
+    });
+    EXPECT_EQ(1u, select(c.recv_case(ai), a.send_case(6)));
+    EXPECT_EQ(6, a.recv());
+
+    task::spawn([=] {
+        channel<int> bb = b;
+        this_task::sleep_for(std::chrono::milliseconds{5});
+        bb.send(7);
+    });
+    EXPECT_TRUE(b.timed_recv(bi, std::chrono::milliseconds{1000}));
+    EXPECT_EQ(7, bi);
+
+    b.close();
+    EXPECT_THROW(select(a.recv_case(ai), b.recv_case(bi)), channel_closed_error);
+
+    channel<int, ring<4>> r;
+    r.send(8);
+    EXPECT_EQ(1u, select(a.recv_case(ai), r.recv_case(bi)));
+    EXPECT_EQ(8, bi);
+    EXPECT_FALSE(r.timed_recv(bi, std::chrono::milliseconds{1}));
+}
+
+TEST(Channel, Select) {
+    task::main([] {
+        task::spawn(select_test_task);
+    });
+}
+
+static void select_threaded_task() {
+    const int nthreads = 4;
+    const int per_thread = 10000;
+    channel<int> a{16};
+    channel<int, ring<16>> b;
+    std::vector<std::thread> threads;
+    for (int n=0; n<nthreads; ++n) {
+        threads.emplace_back(task::spawn_thread([=] {
+            channel<int> aa = a;
+            channel<int, ring<16>> bb = b;
+            for (int i=0; i<per_thread; ++i) {
+                aa.send(1);
+                bb.send(2);
+            }
+        }));
+    }
+    int ai = 0, bi = 0;
+    int64_t total = 0;
+    for (int i=0; i<nthreads * per_thread * 2; ++i) {
+        if (select(a.recv_case(ai), b.recv_case(bi)) == 0) {
+            total += ai;
+        } else {
+            total += bi;
+        }
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(nthreads * per_thread * 3, total);
+    EXPECT_TRUE(a.empty());
+    EXPECT_TRUE(b.empty());
+}
+
+TEST(Channel, SelectThreaded) {
+    task::main([] {
+        task::spawn(select_threaded_task);
+    });
+}
+
+static void select_unbuffered_race_task() {
+    const int nthreads = 2;
+    const int per_thread = 5000;
+    const int total = nthreads * per_thread * 2;
+    channel<int> a;
+    channel<int> b;
+    std::shared_ptr<std::atomic<int>> received{std::make_shared<std::atomic<int>>(0)};
+    std::vector<std::thread> threads;
+    for (int n=0; n<nthreads; ++n) {
+        threads.emplace_back(task::spawn_thread([=] {
+            channel<int> aa = a;
+            for (int i=0; i<per_thread; ++i) aa.send(1);
+        }));
+        threads.emplace_back(task::spawn_thread([=] {
+            channel<int> bb = b;
+            for (int i=0; i<per_thread; ++i) bb.send(1);
+        }));
+    }
+    // plain receivers block until close, so an item a select let in and
+    // then left behind is only taken if its wakeup was handed on
+    std::vector<std::thread> receivers;
+    for (auto c : {a, b}) {
+        receivers.emplace_back(task::spawn_thread([=] {
+            channel<int> cc = c;
+            try {
+                for (;;) *received += cc.recv();
+            } catch (channel_closed_error &) {}
+        }));
+    }
+    int ai = 0, bi = 0;
+    for (int i=0; i<total / 4; ++i) {
+        select(a.recv_case(ai), b.recv_case(bi));
+        ++*received;
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    const auto deadline = kernel::now() + std::chrono::seconds{5};
+    while (*received < total && kernel::now() < deadline) {
+        this_task::sleep_for(std::chrono::milliseconds{1});
+    }
+    EXPECT_EQ(total, received->load());
+    a.close();
+    b.close();
+    for (auto &t : receivers) {
+        t.join();
+    }
+    EXPECT_EQ(total, received->load());
+}
+
+TEST(Channel, SelectUnbufferedRace) {
+    task::main([] {
+        task::spawn(select_unbuffered_race_task);
+    });
+}
+
+template <class Channel>
+static void batch_test(Channel c) {
+    const int count = 1000;
+    task::spawn([=] {
+        Channel out = c;
+        std::vector<int> items;
+        for (int i=0; i<count; ++i) {
+            items.push_back(i);
+        }
+        EXPECT_EQ((size_t)count, out.send_batch(items));
+        out.close();
+    });
+    std::vector<int> got;
+    try {
+        for (;;) {
+            size_t n = c.recv_batch(std::back_inserter(got), 64);
+            EXPECT_GT(n, 0u);
+            EXPECT_LE(n, 64u);
+        }
+    } catch (channel_closed_error &e) {}
+    ASSERT_EQ((size_t)count, got.size());
+    for (int i=0; i<count; ++i) {
+        EXPECT_EQ(i, got[i]);
+    }
+}
+
+//! counts up from 0, closing c when it reaches close_at
+template <class Channel>
+struct closing_iterator {
+    Channel *c;
+    int i;
+    int close_at;
+
+    int operator *() const { return i; }
+    closing_iterator &operator ++() {
+        if (++i == close_at) c->close();
+        return *this;
+    }
+    bool operator != (const closing_iterator &o) const { return i != o.i; }
+};
+
+template <class Channel>
+static void batch_close_test(Channel c) {
+    // closed part way through with room left, the rest isn't sent.
+    // only for ring channels, channel<T> holds its lock while sending
+    typedef closing_iterator<Channel> it;
+    EXPECT_THROW(c.send_batch(it{&c, 0, 3}, it{&c, 8, 3}), channel_closed_error);
+    EXPECT_EQ(3u, c.unread());
+}
+
+TEST(Channel, Batch) {
+    task::main([] {
+        task::spawn([] {
+            batch_test(channel<int>{});
+            batch_test(channel<int>{16});
+            batch_test(channel<int>{4096});
+            batch_test(channel<int, ring<16>>{});
+            batch_close_test(channel<int, ring<16>>{});
+
+            channel<int> c{8};
+            EXPECT_EQ(3u, c.send_batch(std::vector<int>{1, 2, 3}));
+            int out[8];
+            EXPECT_EQ(2u, c.recv_batch(out, 2));
+            EXPECT_EQ(1, out[0]);
+            EXPECT_EQ(2, out[1]);
+            EXPECT_EQ(1u, c.recv_batch(out, 8));
+            EXPECT_EQ(3, out[0]);
+            EXPECT_EQ(0u, c.recv_batch(out, 0));
+            c.close();
+            EXPECT_THROW(c.recv_batch(out, 8), channel_closed_error);
+        });
+    });
+}
+
+TEST(Channel, BatchThreaded) {
+    task::main([] {
+        task::spawn([] {
+            typedef channel<uint64_t, ring<64>> ring_channel;
+            const int nthreads = 4;
+            const uint64_t per_thread = 100000;
+            ring_channel c;
+            channel<uint64_t> sums{nthreads};
+            std::vector<std::thread> threads;
+            for (int n=0; n<nthreads; ++n) {
+                threads.emplace_back(task::spawn_thread([=] {
+                    ring_channel rc = c;
+                    std::vector<uint64_t> batch;
+                    for (uint64_t i=1; i<=per_thread; ++i) {
+                        batch.push_back(i);
+                        if (batch.size() == 100) {
+                            rc.send_batch(batch);
+                            batch.clear();
+                        }
+                    }
+                }));
+                threads.emplace_back(task::spawn_thread([=] {
+                    ring_channel rc = c;
+                    channel<uint64_t> s = sums;
+                    uint64_t buf[32];
+                    uint64_t sum = 0;
+                    uint64_t received = 0;
+                    while (received < per_thread) {
+                        size_t n = rc.recv_batch(buf, std::min<uint64_t>(32, per_thread - received));
+                        for (size_t i=0; i<n; ++i) sum += buf[i];
+                        received += n;
+                    }
+                    s.send(std::move(sum));
+                }));
+            }
+            uint64_t total = 0;
+            for (int n=0; n<nthreads; ++n) {
+                total += sums.recv();
+            }
+            for (auto &t : threads) {
+                t.join();
+            }
+            EXPECT_EQ(nthreads * (per_thread * (per_thread + 1) / 2), total);
+        });
+    });
+}
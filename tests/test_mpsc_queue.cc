@@ -0,0 +1,67 @@
+#include "gtest/gtest.h"
+#include "ten/mpsc_queue.hh"
+#include <thread>
+#include <vector>
+
+using namespace ten;
+
+struct item {
+    int value;
+    item *next = nullptr;
+
+    explicit item(int v) : value(v) {}
+};
+
+typedef mpsc_queue<item, &item::next> item_queue;
+
+TEST(MpscQueue, Order) {
+    item_queue q;
+    EXPECT_TRUE(q.empty());
+    item a{1}, b{2}, c{3};
+    q.push(&a);
+    q.push(&b);
+    q.push(&c);
+    EXPECT_FALSE(q.empty());
+    std::vector<int> got;
+    EXPECT_EQ(3u, q.drain([&](item *i) { got.push_back(i->value); }));
+    EXPECT_EQ((std::vector<int>{1, 2, 3}), got);
+    EXPECT_TRUE(q.empty());
+    EXPECT_EQ(0u, q.drain([&](item *i) { got.push_back(i->value); }));
+    // items can go back in once drained
+    q.push(&b);
+    EXPECT_EQ(1u, q.drain([&](item *i) { EXPECT_EQ(&b, i); }));
+}
+
+TEST(MpscQueue, Threaded) {
+    const int nthreads = 4;
+    const int per_thread = 100000;
+    item_queue q;
+    std::vector<std::vector<item>> items(nthreads);
+    std::vector<std::thread> threads;
+    for (int n=0; n<nthreads; ++n) {
+        for (int i=0; i<per_thread; ++i) {
+            items[n].emplace_back(n * per_thread + i);
+        }
+    }
+    for (int n=0; n<nthreads; ++n) {
+        threads.emplace_back([&, n] {
+            for (auto &i : items[n]) {
+                q.push(&i);
+            }
+        });
+    }
+    // each producer's items come out in the order it pushed them
+    std::vector<int> last(nthreads, -1);
+    int count = 0;
+    while (count < nthreads * per_thread) {
+        count += q.drain([&](item *i) {
+            const int n = i->value / per_thread;
+            EXPECT_LT(last[n], i->value);
+            last[n] = i->value;
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    EXPECT_TRUE(q.empty());
+}
@@ -98,3 +98,403 @@ TEST(Net, HttpServerClientGet) {
     });
 }
 
+
+//! connect client to server over loopback
+static void connected_pair(netsock &client, netsock &server) {
+    netsock listener{AF_INET, SOCK_STREAM};
+    address addr{"127.0.0.1", 0};
+    listener.bind(addr);
+    listener.getsockname(addr);
+    listener.listen();
+    client = netsock{AF_INET, SOCK_STREAM};
+    ASSERT_EQ(0, client.connect(addr));
+    address peer;
+    server = netsock{listener.accept(peer)};
+}
+
+static void persistent_echo_test() {
+    netsock s, cs;
+    ASSERT_NO_FATAL_FAILURE(connected_pair(s, cs));
+
+    auto server_task = task::spawn([&] {
+        cs.persist();
+        char buf[64];
+        ssize_t nr;
+        while ((nr = cs.recv(buf, sizeof(buf))) > 0) {
+            EXPECT_EQ(nr, cs.send(buf, nr));
+        }
+    });
+
+    s.persist();
+    char buf[5];
+    for (int i=0; i<100; ++i) {
+        EXPECT_EQ(5, s.send("hello", 5));
+        EXPECT_EQ(5, s.recvall(buf, sizeof(buf)));
+        EXPECT_EQ("hello", std::string(buf, sizeof(buf)));
+    }
+
+    // nothing more coming, wait for an edge that never happens
+    EXPECT_EQ(-1, s.recv(buf, sizeof(buf), 0, milliseconds{5}));
+
+    // echoed data arrives while we sleep, so the edge has to be remembered,
+    // edge triggered epoll won't report it to the wait below again
+    EXPECT_EQ(5, s.send("world", 5));
+    this_task::sleep_for(milliseconds{5});
+    EXPECT_TRUE(fdwait(s.s.fd, 'r', milliseconds{100}));
+    // a partial read, then drain to EAGAIN
+    EXPECT_EQ(2, s.recv(buf, 2));
+    EXPECT_EQ(3, s.recv(buf + 2, 3));
+    EXPECT_EQ("world", std::string(buf, sizeof(buf)));
+    EXPECT_EQ(-1, ::recv(s.s.fd, buf, sizeof(buf), MSG_DONTWAIT));
+    EXPECT_TRUE(io_not_ready());
+    // the cached edge was used up by the wait above
+    EXPECT_FALSE(fdwait(s.s.fd, 'r', milliseconds{5}));
+    // and a new one wakes the waiter
+    EXPECT_EQ(5, s.send("again", 5));
+    EXPECT_TRUE(fdwait(s.s.fd, 'r', milliseconds{1000}));
+    EXPECT_EQ(5, s.recvall(buf, sizeof(buf)));
+    EXPECT_EQ("again", std::string(buf, sizeof(buf)));
+
+    s.close();
+    server_task.join();
+}
+
+TEST(Net, PersistentEcho) {
+    task::main([] {
+        task::spawn(persistent_echo_test);
+    });
+}
+
+static void persist_reuse_test() {
+    netsock listener{AF_INET, SOCK_STREAM};
+    address addr{"127.0.0.1", 0};
+    listener.bind(addr);
+    listener.getsockname(addr);
+    listener.listen();
+
+    auto server_task = task::spawn([&] {
+        for (int i=0; i<2; ++i) {
+            address client_addr;
+            netsock cs{listener.accept(client_addr)};
+            char buf[64];
+            ssize_t nr;
+            while ((nr = cs.recv(buf, sizeof(buf))) > 0) {
+                EXPECT_EQ(nr, cs.send(buf, nr));
+            }
+        }
+    });
+
+    // the next socket gets the number of a persisted one that was closed
+    // without netsock knowing, first here and then in another thread
+    auto echo_on_reused = [&](int old_fd) {
+        netsock s{AF_INET, SOCK_STREAM};
+        EXPECT_EQ(old_fd, s.s.fd);
+        ASSERT_EQ(0, s.connect(addr, milliseconds{1000}));
+        EXPECT_EQ(5, s.send("hello", 5));
+        char buf[5];
+        EXPECT_EQ(5, s.recvall(buf, sizeof(buf), milliseconds{1000}));
+    };
+
+    {
+        netsock s{AF_INET, SOCK_STREAM};
+        s.persist();
+        const int fd = s.s.fd;
+        socket_fd moved{std::move(s.s)};
+        moved.close();
+        echo_on_reused(fd);
+    }
+    {
+        netsock s{AF_INET, SOCK_STREAM};
+        s.persist();
+        const int fd = s.s.fd;
+        socket_fd moved{std::move(s.s)};
+        std::thread t([&] { moved.close(); });
+        t.join();
+        echo_on_reused(fd);
+    }
+    server_task.join();
+}
+
+TEST(Net, PersistReuse) {
+    task::main([] {
+        task::spawn(persist_reuse_test);
+    });
+}
+
+static void uring_echo_test() {
+    EXPECT_EQ(kernel::io_backend::uring, kernel::backend());
+
+    netsock s, cs;
+    ASSERT_NO_FATAL_FAILURE(connected_pair(s, cs));
+    auto server_task = task::spawn([&] {
+        char buf[64];
+        ssize_t nr;
+        while ((nr = cs.recv(buf, sizeof(buf))) > 0) {
+            EXPECT_EQ(nr, cs.send(buf, nr));
+        }
+    });
+
+    EXPECT_EQ(5, s.send("hello", 5));
+    char buf[5];
+    EXPECT_EQ(5, s.recvall(buf, sizeof(buf)));
+    EXPECT_EQ("hello", std::string(buf, sizeof(buf)));
+
+    // nothing more coming, so this times out and is canceled in the ring
+    EXPECT_EQ(-1, s.recv(buf, sizeof(buf), 0, milliseconds{5}));
+    EXPECT_EQ(ETIMEDOUT, errno);
+
+    s.close();
+    server_task.join();
+}
+
+TEST(Net, UringEcho) {
+    task::main([] {
+        task::spawn(uring_echo_test);
+    }, nullopt, kernel::io_backend::uring);
+}
+
+TEST(Net, UringHttpServerClientGet) {
+    task::main([] {
+        task::spawn(start_http_test);
+    }, nullopt, kernel::io_backend::uring);
+}
+
+static void vectored_test() {
+    netsock s, cs;
+    ASSERT_NO_FATAL_FAILURE(connected_pair(s, cs));
+
+    // big enough that sendv has to wait and finish a partial write
+    const std::string head(100, 'h');
+    std::string body(4 * 1024 * 1024, 0);
+    for (size_t i=0; i<body.size(); ++i) body[i] = 'a' + i % 26;
+    const std::string tail(3, 't');
+
+    auto server_task = task::spawn([&] {
+        iovec iov[3] = {
+            {const_cast<char *>(head.data()), head.size()},
+            {const_cast<char *>(body.data()), body.size()},
+            {const_cast<char *>(tail.data()), tail.size()},
+        };
+        EXPECT_EQ(ssize_t(head.size() + body.size() + tail.size()), cs.sendv(iov, 3));
+        cs.close();
+    });
+
+    std::string got;
+    char a[7];
+    char b[4096];
+    for (;;) {
+        iovec iov[2] = {{a, sizeof(a)}, {b, sizeof(b)}};
+        ssize_t nr = s.recvv(iov, 2);
+        if (nr <= 0) break;
+        got.append(a, std::min<size_t>(nr, sizeof(a)));
+        if (nr > (ssize_t)sizeof(a)) got.append(b, nr - sizeof(a));
+    }
+    EXPECT_EQ(head + body + tail, got);
+    server_task.join();
+}
+
+TEST(Net, Vectored) {
+    task::main([] {
+        task::spawn(vectored_test);
+    });
+}
+
+static void http_file_test() {
+    char path[] = "/tmp/ten_test_net_XXXXXX";
+    int tmp = mkstemp(path);
+    ASSERT_NE(-1, tmp);
+    std::string contents;
+    for (int i=0; i<100000; ++i) contents += char('a' + i % 26);
+    ASSERT_EQ((ssize_t)contents.size(), write(tmp, contents.data(), contents.size()));
+    close(tmp);
+
+    address http_addr("127.0.0.1");
+    auto server_task = task::spawn([&] {
+        auto s = std::make_shared<http_server>();
+        s->add_route("/short", [&](http_exchange &ex) {
+            // the file shrinks after Content-Length is set
+            char short_path[] = "/tmp/ten_test_net_XXXXXX";
+            auto f = std::make_shared<fd_base>(mkstemp(short_path));
+            unlink(short_path);
+            ASSERT_EQ((ssize_t)contents.size(), f->write(contents.data(), contents.size()));
+            ex.resp = { 200 };
+            ex.resp.set_file_body(f);
+            ASSERT_EQ(0, ftruncate(f->fd, 10));
+            EXPECT_EQ(-1, ex.send_response());
+            EXPECT_EQ(EIO, errno);
+            EXPECT_FALSE(ex.sock.valid());
+        });
+        s->add_route("*", [&](http_exchange &ex) {
+            auto f = std::make_shared<file_fd>(path, O_RDONLY, 0);
+            ex.resp = { 200 };
+            ex.resp.set_file_body(f, 0, nullopt, std::string("text/plain"));
+        });
+        s->serve(http_addr);
+    });
+    this_task::yield();
+
+    http_client c{http_addr.str()};
+    auto resp = c.get("/file");
+    EXPECT_EQ(200, resp.status_code);
+    EXPECT_EQ(contents, resp.body);
+    EXPECT_EQ("bytes", get_value_or(resp.get("Accept-Ranges"), ""));
+
+    http_request r{"GET", "/file"};
+    r.set("Range", "bytes=10-19");
+    resp = c.perform(r);
+    EXPECT_EQ(206, resp.status_code);
+    EXPECT_EQ(contents.substr(10, 10), resp.body);
+    EXPECT_EQ("bytes 10-19/100000", get_value_or(resp.get("Content-Range"), ""));
+
+    r.set("Range", "bytes=-5");
+    resp = c.perform(r);
+    EXPECT_EQ(206, resp.status_code);
+    EXPECT_EQ(contents.substr(contents.size() - 5), resp.body);
+
+    r.set("Range", "bytes=200000-");
+    resp = c.perform(r);
+    EXPECT_EQ(416, resp.status_code);
+    EXPECT_EQ("bytes */100000", get_value_or(resp.get("Content-Range"), ""));
+
+    http_request h{"HEAD", "/file"};
+    resp = c.perform(h);
+    EXPECT_EQ(200, resp.status_code);
+    EXPECT_EQ("100000", get_value_or(resp.get("Content-Length"), ""));
+    EXPECT_TRUE(resp.body.empty());
+
+    // still in sync after a HEAD
+    resp = c.get("/file");
+    EXPECT_EQ(contents, resp.body);
+
+    // a body that falls short closes the connection instead of
+    // leaving the client to read the next response as its body
+    http_client c2{http_addr.str()};
+    EXPECT_THROW(c2.get("/short"), errorx);
+
+    server_task.cancel();
+    server_task.join();
+    unlink(path);
+}
+
+TEST(Net, HttpParseRange) {
+    using r = http_exchange::range_result;
+    size_t first = 0, last = 0;
+    EXPECT_EQ(r::ok, http_exchange::parse_range("bytes=10-19", 100, first, last));
+    EXPECT_EQ(10u, first);
+    EXPECT_EQ(19u, last);
+    EXPECT_EQ(r::ok, http_exchange::parse_range("bytes=90-", 100, first, last));
+    EXPECT_EQ(99u, last);
+    EXPECT_EQ(r::ok, http_exchange::parse_range("bytes=-5", 100, first, last));
+    EXPECT_EQ(95u, first);
+    EXPECT_EQ(r::none, http_exchange::parse_range("bytes=0-1,5-6", 100, first, last));
+    EXPECT_EQ(r::none, http_exchange::parse_range("lines=0-1", 100, first, last));
+    // numbers too big for size_t saturate instead of wrapping around
+    EXPECT_EQ(r::unsatisfiable, http_exchange::parse_range(
+                "bytes=18446744073709551626-", 100, first, last));
+    EXPECT_EQ(r::ok, http_exchange::parse_range(
+                "bytes=50-18446744073709551626", 100, first, last));
+    EXPECT_EQ(50u, first);
+    EXPECT_EQ(99u, last);
+    EXPECT_EQ(r::ok, http_exchange::parse_range(
+                "bytes=-18446744073709551626", 100, first, last));
+    EXPECT_EQ(0u, first);
+    EXPECT_EQ(99u, last);
+}
+
+TEST(Net, HttpFileBody) {
+    task::main([] {
+        task::spawn(http_file_test);
+    });
+}
+
+static void sendfile_pipe_test() {
+    netsock s, cs;
+    ASSERT_NO_FATAL_FAILURE(connected_pair(s, cs));
+
+    pipe_fd p{O_NONBLOCK};
+    auto server_task = task::spawn([&] {
+        EXPECT_EQ(10, netsendfile(cs.s.fd, p.r.fd, 0, 10, nullopt));
+    });
+    // the sender waits on the empty pipe until this arrives
+    this_task::yield();
+    EXPECT_EQ(5, p.write("hello", 5));
+    this_task::sleep_for(milliseconds{1});
+    EXPECT_EQ(5, p.write("world", 5));
+    char buf[10];
+    EXPECT_EQ(10, s.recvall(buf, sizeof(buf)));
+    EXPECT_EQ("helloworld", std::string(buf, sizeof(buf)));
+    server_task.join();
+}
+
+TEST(Net, SendfilePipe) {
+    task::main([] {
+        task::spawn(sendfile_pipe_test);
+    });
+}
+
+static void proxy_test() {
+    netsock c1, a, c2, b;
+    ASSERT_NO_FATAL_FAILURE(connected_pair(c1, a));
+    ASSERT_NO_FATAL_FAILURE(connected_pair(c2, b));
+
+    netproxy_stats st;
+    auto proxy_task = task::spawn([&] {
+        st = netproxy(a, b);
+    });
+
+    std::string big(1024*1024, 'x');
+    auto send_task = task::spawn([&] {
+        EXPECT_EQ((ssize_t)big.size(), c1.send(big.data(), big.size()));
+        // passed on as a half-close
+        EXPECT_EQ(0, c1.shutdown(SHUT_WR));
+    });
+    std::string got;
+    char buf[16*1024];
+    for (;;) {
+        ssize_t nr = c2.recv(buf, sizeof(buf));
+        ASSERT_LE(0, nr);
+        if (nr == 0) break;
+        got.append(buf, nr);
+    }
+    send_task.join();
+    EXPECT_EQ(big, got);
+
+    // the other way still works after the half-close
+    EXPECT_EQ(3, c2.send("bye", 3));
+    c2.close();
+    // both ways are done once the proxy returns, so the data and the
+    // close are already queued for c1
+    proxy_task.join();
+    EXPECT_EQ(3, c1.recvall(buf, 3));
+    EXPECT_EQ("bye", std::string(buf, 3));
+    EXPECT_EQ(0, c1.recv(buf, sizeof(buf)));
+    EXPECT_EQ(big.size(), st.a_to_b);
+    EXPECT_EQ(3u, st.b_to_a);
+    EXPECT_EQ(0, st.a_to_b_error);
+    EXPECT_EQ(0, st.b_to_a_error);
+}
+
+TEST(Net, Proxy) {
+    task::main([] {
+        task::spawn(proxy_test);
+    });
+}
+
+static void proxy_timeout_test() {
+    netsock c1, a, c2, b;
+    ASSERT_NO_FATAL_FAILURE(connected_pair(c1, a));
+    ASSERT_NO_FATAL_FAILURE(connected_pair(c2, b));
+
+    // nothing moves, so both ways time out and the clients see the close
+    netproxy_stats st = netproxy(a, b, milliseconds{10});
+    EXPECT_EQ(ETIMEDOUT, st.a_to_b_error ? st.a_to_b_error : st.b_to_a_error);
+    char buf[16];
+    EXPECT_EQ(0, c1.recv(buf, sizeof(buf), 0, milliseconds{100}));
+    EXPECT_EQ(0, c2.recv(buf, sizeof(buf), 0, milliseconds{100}));
+}
+
+TEST(Net, ProxyTimeout) {
+    task::main([] {
+        task::spawn(proxy_timeout_test);
+    });
+}
@@ -4,6 +4,7 @@
 #include "ten/synchronized.hh"
 #include "ten/thread_guard.hh"
 #include "ten/task/rendez.hh"
+#include "ten/task/shared_qutex.hh"
 
 using namespace ten;
 
@@ -61,3 +62,176 @@ TEST(Qutex, Synchronized) {
 
     EXPECT_EQ(*sync_view(s), "test2");
 }
+
+TEST(Qutex, Spin) {
+    task::main([] {
+        std::shared_ptr<state> st = std::make_shared<state>();
+        auto before = kernel::qutex_stats();
+        kernel::set_qutex_spin(0);
+        {
+            std::vector<thread_guard> threads;
+            for (int i=0; i<4; ++i) {
+                threads.emplace_back(task::spawn_thread([=] {
+                    qlocker(st);
+                }));
+            }
+        }
+        auto after = kernel::qutex_stats();
+        EXPECT_EQ(4*1000, st->x);
+        EXPECT_EQ(before.spun, after.spun);
+
+        kernel::set_qutex_spin(1000);
+        // an owner that is asleep isn't spun on, the locker parks at once
+        {
+            std::unique_lock<qutex> lk{st->q};
+            thread_guard locker{task::spawn_thread([=] {
+                std::unique_lock<qutex> l{st->q};
+                ++st->x;
+            })};
+            const auto deadline = kernel::now() + std::chrono::seconds{5};
+            while (kernel::qutex_stats().parked == after.parked && kernel::now() < deadline) {
+                this_task::sleep_for(std::chrono::milliseconds{1});
+            }
+            auto held = kernel::qutex_stats();
+            EXPECT_EQ(after.parked + 1, held.parked);
+            EXPECT_EQ(after.spun, held.spun);
+            lk.unlock();
+        }
+        EXPECT_EQ(4*1000 + 1, st->x);
+
+        // owners running on other cpus hold it briefly, so some spins win
+        after = kernel::qutex_stats();
+        {
+            std::vector<thread_guard> threads;
+            for (int i=0; i<4; ++i) {
+                threads.emplace_back(task::spawn_thread([=] {
+                    qlocker(st);
+                }));
+            }
+        }
+        kernel::set_qutex_spin(200);
+        EXPECT_EQ(8*1000 + 1, st->x);
+        auto last = kernel::qutex_stats();
+        if (std::thread::hardware_concurrency() > 1) {
+            EXPECT_GT(last.spun, after.spun);
+        }
+    });
+}
+
+TEST(SharedQutex, Readers) {
+    task::main([] {
+        shared_qutex m;
+        int holding = 0;
+        int most = 0;
+        for (int i=0; i<5; ++i) {
+            task::spawn([&] {
+                shared_lock<shared_qutex> lk{m};
+                ++holding;
+                most = std::max(most, holding);
+                this_task::yield();
+                --holding;
+            });
+        }
+        kernel::wait_for_tasks();
+        EXPECT_EQ(5, most);
+        EXPECT_TRUE(m.try_lock());
+        EXPECT_FALSE(m.try_lock_shared());
+        m.unlock();
+    });
+}
+
+TEST(SharedQutex, WriterPreference) {
+    task::main([] {
+        shared_qutex m;
+        std::vector<std::string> order;
+        m.lock_shared();
+        task::spawn([&] {
+            std::lock_guard<shared_qutex> lk{m};
+            order.push_back("writer");
+        });
+        this_task::yield();
+        // the writer is waiting, so new readers have to wait too
+        EXPECT_FALSE(m.try_lock_shared());
+        task::spawn([&] {
+            shared_lock<shared_qutex> lk{m};
+            order.push_back("reader");
+        });
+        this_task::yield();
+        EXPECT_TRUE(order.empty());
+        m.unlock_shared();
+        kernel::wait_for_tasks();
+        ASSERT_EQ(2u, order.size());
+        EXPECT_EQ("writer", order[0]);
+        EXPECT_EQ("reader", order[1]);
+    });
+}
+
+TEST(SharedQutex, Threaded) {
+    task::main([] {
+        struct shared {
+            shared_qutex m;
+            uint64_t a = 0;
+            uint64_t b = 0;
+            shared() {}
+        };
+        auto st = std::make_shared<shared>();
+        std::atomic<int> torn{0};
+        std::vector<thread_guard> threads;
+        for (int i=0; i<4; ++i) {
+            threads.emplace_back(task::spawn_thread([=, &torn] {
+                for (int j=0; j<1000; ++j) {
+                    if (j % 10 == i) {
+                        std::lock_guard<shared_qutex> lk{st->m};
+                        ++st->a;
+                        this_task::yield();
+                        ++st->b;
+                    } else {
+                        shared_lock<shared_qutex> lk{st->m};
+                        if (st->a != st->b) ++torn;
+                    }
+                }
+            }));
+        }
+        threads.clear();
+        EXPECT_EQ(0, torn.load());
+        EXPECT_EQ(400u, st->a);
+        EXPECT_EQ(400u, st->b);
+    });
+}
+
+TEST(Rendez, CancelWaiters) {
+    task::main([] {
+        qutex q;
+        rendez r;
+        bool go = false;
+        int woken = 0;
+        int canceled = 0;
+        std::vector<task> tasks;
+        for (int i=0; i<10; ++i) {
+            tasks.push_back(task::spawn([&] {
+                try {
+                    std::unique_lock<qutex> lk{q};
+                    r.sleep(lk, [&] { return go; });
+                    ++woken;
+                } catch (task_interrupted &) {
+                    ++canceled;
+                }
+            }));
+        }
+        this_task::yield();
+        // take waiters off the front, back and middle of the list
+        tasks[0].cancel();
+        tasks[9].cancel();
+        tasks[4].cancel();
+        this_task::yield();
+        EXPECT_EQ(3, canceled);
+        {
+            std::lock_guard<qutex> lk{q};
+            go = true;
+        }
+        r.wakeupall();
+        kernel::wait_for_tasks();
+        EXPECT_EQ(7, woken);
+        EXPECT_EQ(3, canceled);
+    });
+}
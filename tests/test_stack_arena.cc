@@ -0,0 +1,47 @@
+#include "gtest/gtest.h"
+#include "ten/channel.hh"
+#include "ten/task.hh"
+
+// an arena can't be removed once stacks come from it, so it gets this
+// process to itself rather than leaking into the other task tests
+
+using namespace ten;
+
+static int touch_stack(int depth) {
+    volatile char buf[1024];
+    buf[0] = depth;
+    return depth ? touch_stack(depth - 1) + buf[0] : 0;
+}
+
+TEST(Task, StackArena) {
+    ASSERT_TRUE(kernel::use_stack_arena(2048));
+    task::main([]{
+        // more tasks than the thread's stack cache holds, all alive at once
+        const int ntasks = 1000;
+        channel<int> done{ntasks};
+        channel<int> go;
+        for (int i=0; i<ntasks; ++i) {
+            task::spawn([=] {
+                channel<int> g = go;
+                channel<int> d = done;
+                int n = touch_stack(16);
+                try {
+                    g.recv();
+                } catch (channel_closed_error &) {}
+                d.send(std::move(n));
+            });
+        }
+        this_task::yield();
+        go.close();
+        for (int i=0; i<ntasks; ++i) {
+            EXPECT_EQ(136, done.recv());
+        }
+    });
+    // cached arena stacks are reused
+    task::main([]{
+        int n = 0;
+        task::spawn([&] { n = touch_stack(16); });
+        kernel::wait_for_tasks();
+        EXPECT_EQ(136, n);
+    });
+}
@@ -1,9 +1,13 @@
 #include "gtest/gtest.h"
 #include <thread>
+#include <set>
+#include <memory>
 #include "ten/descriptors.hh"
 #include "ten/semaphore.hh"
 #include "ten/channel.hh"
 #include "ten/task.hh"
+#include "ten/task/task_pool.hh"
+#include "ten/metrics.hh"
 
 using namespace ten;
 using namespace std::chrono;
@@ -186,6 +190,32 @@ TEST(Task, ManyTimeouts) {
     EXPECT_EQ(count, 3000);
 }
 
+TEST(Task, ManyCanceledTimeouts) {
+    task::main([] {
+        // arm lots of deadlines and cancel them out of order,
+        // only the shortest should ever fire
+        std::vector<std::unique_ptr<deadline>> deadlines;
+        for (int i=0; i<1000; ++i) {
+            deadlines.emplace_back(new deadline{milliseconds{100 + (i * 7919) % 1000}});
+        }
+        for (size_t i=0; i<deadlines.size(); i+=2) {
+            deadlines[i].reset();
+        }
+        deadline first{milliseconds{10}};
+        for (size_t i=1; i<deadlines.size(); i+=2) {
+            deadlines[i].reset();
+        }
+        bool reached = false;
+        try {
+            this_task::sleep_for(milliseconds{200});
+        } catch (deadline_reached &e) {
+            reached = true;
+        }
+        EXPECT_TRUE(reached);
+        EXPECT_EQ(milliseconds{0}, *first.remaining());
+    });
+}
+
 static void long_sleeper() {
     this_task::sleep_for(seconds{10});
     EXPECT_TRUE(false);
@@ -464,3 +494,483 @@ TEST(Task, Join) {
     });
 }
 
+
+static void busy_for(milliseconds ms) {
+    // don't yield, so only another thread can run the other tasks
+    auto stop = steady_clock::now() + ms;
+    while (steady_clock::now() < stop) {}
+}
+
+TEST(Task, WorkStealing) {
+    task::main([]{
+        kernel::set_work_stealing(true);
+        channel<std::thread::id> ran{100};
+        channel<int> quit;
+        std::thread thief = task::spawn_thread([=] {
+            kernel::set_work_stealing(true);
+            channel<int> q = quit;
+            q.recv();
+        });
+        std::this_thread::sleep_for(milliseconds{10});
+        for (int i=0; i<20; ++i) {
+            task::spawn([=] {
+                busy_for(milliseconds{2});
+                channel<std::thread::id> r = ran;
+                r.send(std::this_thread::get_id());
+            });
+        }
+        const auto main_id = std::this_thread::get_id();
+        int pinned_ran = 0;
+        std::vector<task> pinned;
+        for (int i=0; i<5; ++i) {
+            pinned.emplace_back(task::spawn_pinned([&] {
+                busy_for(milliseconds{2});
+                EXPECT_EQ(main_id, std::this_thread::get_id());
+                ++pinned_ran;
+            }));
+        }
+        std::set<std::thread::id> threads;
+        for (int i=0; i<20; ++i) {
+            threads.insert(ran.recv());
+        }
+        for (auto &t : pinned) {
+            t.join();
+        }
+        EXPECT_EQ(2, threads.size());
+        EXPECT_EQ(5, pinned_ran);
+        quit.send(1);
+        thief.join();
+    });
+}
+
+TEST(Task, CancelWhileStealing) {
+    task::main([]{
+        kernel::set_work_stealing(true);
+        channel<int> quit;
+        std::thread thief = task::spawn_thread([=] {
+            kernel::set_work_stealing(true);
+            channel<int> q = quit;
+            q.recv();
+        });
+        std::this_thread::sleep_for(milliseconds{10});
+        for (int round=0; round<20; ++round) {
+            std::vector<task> tasks;
+            std::atomic<int> started{0};
+            std::atomic<int> interrupted{0};
+            for (int i=0; i<50; ++i) {
+                tasks.emplace_back(task::spawn([&] {
+                    ++started;
+                    const auto id = std::this_thread::get_id();
+                    try {
+                        for (;;) {
+                            this_task::sleep_for(milliseconds{1});
+                            EXPECT_EQ(id, std::this_thread::get_id());
+                        }
+                    } catch (task_interrupted &) {
+                        ++interrupted;
+                        throw;
+                    }
+                }));
+            }
+            // canceled from a thread without a scheduler while some
+            // are still waiting to be stolen or just were
+            std::thread canceler([&] {
+                for (auto &t : tasks) {
+                    t.cancel();
+                }
+            });
+            canceler.join();
+            for (auto &t : tasks) {
+                t.join();
+            }
+            // the ones canceled before they ran never start
+            EXPECT_EQ(started.load(), interrupted.load());
+        }
+        quit.send(1);
+        thief.join();
+    });
+}
+
+TEST(Task, CancelWhileExiting) {
+    task::main([]{
+        std::vector<task> tasks;
+        int finished = 0;
+        for (int i=0; i<100; ++i) {
+            tasks.push_back(task::spawn([&, i] {
+                this_task::yield();
+                // no cancellation point after this, so the task
+                // exits while it sits in the ready queue
+                tasks[i].cancel();
+                ++finished;
+            }));
+        }
+        // keep some other tasks around so exits move them in the task list
+        std::vector<task> sleepers;
+        for (int i=0; i<10; ++i) {
+            sleepers.push_back(task::spawn([] {
+                try {
+                    this_task::sleep_for(hours{1});
+                } catch (task_interrupted &) {}
+            }));
+        }
+        this_task::yield();
+        this_task::yield();
+        EXPECT_EQ(100, finished);
+        for (auto &t : sleepers) {
+            t.cancel();
+        }
+    });
+}
+
+TEST(Task, Pool) {
+    task::main([]{
+        std::set<uint64_t> ids;
+        int ran = 0;
+        {
+            task_pool pool{4};
+            for (int round=0; round<3; ++round) {
+                for (int i=0; i<4; ++i) {
+                    pool.spawn([&] {
+                        this_task::yield();
+                        ids.insert(this_task::get_id());
+                        ++ran;
+                    });
+                }
+                while (pool.idle() < 4) this_task::yield();
+            }
+            EXPECT_EQ(4u, pool.spawned());
+            EXPECT_EQ(8u, pool.reused());
+            EXPECT_EQ(4u, ids.size());
+
+            // more than max_idle at once, the extra tasks exit
+            for (int i=0; i<6; ++i) {
+                pool.spawn([&] {
+                    this_task::yield();
+                    ++ran;
+                });
+            }
+            this_task::yield();
+            this_task::yield();
+            EXPECT_EQ(4u, pool.idle());
+            EXPECT_EQ(6u, pool.spawned());
+        }
+        EXPECT_EQ(18, ran);
+        // destroying the pool let the parked tasks exit
+        kernel::wait_for_tasks();
+    });
+}
+
+static int touch_stack(int depth) {
+    volatile char buf[1024];
+    buf[0] = depth;
+    return depth ? touch_stack(depth - 1) + buf[0] : 0;
+}
+
+static void spawn_blocked_tasks(int ntasks) {
+    channel<int> go;
+    channel<int> done{(size_t)ntasks};
+    for (int i=0; i<ntasks; ++i) {
+        task::spawn([=] {
+            channel<int> g = go;
+            channel<int> d = done;
+            try {
+                g.recv();
+            } catch (channel_closed_error &) {}
+            d.send(1);
+        });
+    }
+    this_task::yield();
+    go.close();
+    for (int i=0; i<ntasks; ++i) {
+        done.recv();
+    }
+}
+
+TEST(Task, StackCacheDepot) {
+    kernel::set_stack_cache_watermarks(8, 32, 4096);
+    task::main([]{
+        const int ntasks = 300;
+        // this thread's stacks end up in the depot when it exits
+        task::spawn_thread([=] { spawn_blocked_tasks(ntasks); }).join();
+        auto before = kernel::stack_cache_stats();
+        EXPECT_GE(before.depot_size, (uint64_t)ntasks);
+        // so this thread shouldn't need new ones
+        task::spawn_thread([=] { spawn_blocked_tasks(ntasks); }).join();
+        auto after = kernel::stack_cache_stats();
+        EXPECT_EQ(before.misses, after.misses);
+        EXPECT_GE(after.refilled - before.refilled, (uint64_t)ntasks);
+        EXPECT_GE(after.spilled - before.spilled, (uint64_t)ntasks);
+        EXPECT_GE(after.hits - before.hits, (uint64_t)ntasks);
+    });
+    kernel::set_stack_cache_watermarks(32, 128, 1024);
+}
+
+TEST(Task, StackSampling) {
+    const int ntasks = 10;
+    const auto before = metrics::global.aggregate();
+    kernel::set_stack_sampling(1);
+    task::main([=]{
+        for (int i=0; i<ntasks; ++i) {
+            task::spawn([=] {
+                taskname("shallow[%d]", i);
+            }, stack_class::small);
+            task::spawn([=] {
+                taskname("deep[%d]", i);
+                touch_stack(40);
+            }, stack_class::medium);
+        }
+        kernel::wait_for_tasks();
+    });
+    kernel::set_stack_sampling(0);
+    const auto m = metrics::global.aggregate() - before;
+    using metrics::counter;
+    EXPECT_EQ(ntasks, metrics::value<counter>(m, "stack", "shallow", "samples"));
+    EXPECT_EQ(ntasks, metrics::value<counter>(m, "stack", "shallow", "fits", "small"));
+    EXPECT_EQ(ntasks, metrics::value<counter>(m, "stack", "deep", "samples"));
+    EXPECT_EQ(ntasks, metrics::value<counter>(m, "stack", "deep", "fits", "medium"));
+    const auto deep = metrics::value<counter>(m, "stack", "deep", "used") / ntasks;
+    const auto shallow = metrics::value<counter>(m, "stack", "shallow", "used") / ntasks;
+    EXPECT_GT(deep, 40 * 1024);
+    EXPECT_LT(shallow, 16 * 1024);
+    using metrics::gauge;
+    const auto deep_max = metrics::value<gauge>(metrics::global.aggregate(), "stack", "deep", "max");
+    EXPECT_GE(deep_max, deep);
+    EXPECT_LT(deep_max, 64 * 1024);
+
+    // shallower samples don't lower it
+    kernel::set_stack_sampling(1);
+    task::main([]{
+        task::spawn([] {
+            taskname("deep[x]");
+        });
+        kernel::wait_for_tasks();
+    });
+    kernel::set_stack_sampling(0);
+    EXPECT_EQ(deep_max, metrics::value<gauge>(metrics::global.aggregate(), "stack", "deep", "max"));
+}
+
+TEST(Task, Profiling) {
+    const int ntasks = 10;
+    const uint64_t nyields = 10;
+    const auto before = metrics::global.aggregate();
+    kernel::set_task_profiling(true);
+    task::main([=]{
+        for (int i=0; i<ntasks; ++i) {
+            task::spawn([=] {
+                taskname("yielder[%d]", i);
+                for (uint64_t j=0; j<nyields; ++j) {
+                    this_task::yield();
+                }
+            });
+        }
+        task::spawn([] {
+            taskname("spinner");
+            for (int i=0; i<2; ++i) {
+                const auto start = steady_clock::now();
+                while (steady_clock::now() - start < milliseconds{2}) {}
+                this_task::yield();
+            }
+        });
+        kernel::wait_for_tasks();
+    });
+    kernel::set_task_profiling(false);
+    const auto m = metrics::global.aggregate() - before;
+    using metrics::counter;
+    using metrics::timer;
+    // the first run and one per yield
+    EXPECT_EQ(ntasks * (nyields + 1), metrics::value<counter>(m, "task", "yielder", "switches"));
+    uint64_t waits = 0;
+    for (auto b : {"lt_10us", "lt_100us", "lt_1ms", "lt_10ms", "ge_10ms"}) {
+        waits += metrics::value<counter>(m, "task", "yielder", "waits", b);
+    }
+    EXPECT_EQ(ntasks * (nyields + 1), waits);
+    EXPECT_GE(metrics::value<timer>(m, "task", "spinner", "run").count(), 4000);
+    EXPECT_EQ(2u, metrics::value<counter>(m, "task", "spinner", "slices", "lt_10ms")
+            + metrics::value<counter>(m, "task", "spinner", "slices", "ge_10ms"));
+}
+
+TEST(Task, Watchdog) {
+    const auto before = metrics::global.aggregate();
+    kernel::set_watchdog(milliseconds{20});
+    task::main([]{
+        // SIGURG the watchdog didn't send is ignored
+        ASSERT_EQ(0, pthread_kill(pthread_self(), SIGURG));
+        task::spawn([] {
+            taskname("hog[1]");
+            const auto start = steady_clock::now();
+            while (steady_clock::now() - start < milliseconds{200}) {}
+        });
+        // a sleeping scheduler is not stalled
+        this_task::sleep_for(milliseconds{100});
+    });
+    kernel::set_watchdog(kernel::duration::zero());
+    const auto m = metrics::global.aggregate() - before;
+    using metrics::counter;
+    EXPECT_EQ(1u, metrics::value<counter>(m, "watchdog", "stalls"));
+    EXPECT_EQ(1u, metrics::value<counter>(m, "watchdog", "stalls", "hog"));
+}
+
+TEST(Task, WatchdogSignal) {
+    const auto before = metrics::global.aggregate();
+    kernel::set_watchdog(milliseconds{20}, SIGUSR2);
+    task::main([]{
+        // SIGUSR2 would kill the process if the watchdog hadn't taken it
+        ASSERT_EQ(0, pthread_kill(pthread_self(), SIGUSR2));
+        task::spawn([] {
+            taskname("usr2hog");
+            const auto start = steady_clock::now();
+            while (steady_clock::now() - start < milliseconds{200}) {}
+        });
+        kernel::wait_for_tasks();
+    });
+    kernel::set_watchdog(kernel::duration::zero());
+    const auto m = metrics::global.aggregate() - before;
+    EXPECT_EQ(1u, metrics::value<metrics::counter>(m, "watchdog", "stalls", "usr2hog"));
+}
+
+TEST(Task, Priority) {
+    task::main([]{
+        int bulk_steps = 0;
+        int most_behind = 0;
+        for (int i=0; i<20; ++i) {
+            task::spawn([&] {
+                for (int j=0; j<10; ++j) {
+                    ++bulk_steps;
+                    this_task::yield();
+                }
+            });
+        }
+        task::spawn([&] {
+            this_task::set_priority(task_priority::critical);
+            EXPECT_EQ(task_priority::critical, this_task::priority());
+            for (int j=0; j<10; ++j) {
+                const int before = bulk_steps;
+                this_task::yield();
+                most_behind = std::max(most_behind, bulk_steps - before);
+            }
+        });
+        // a critical task that never blocks still lets background run
+        bool background_ran = false;
+        task::spawn([&] {
+            this_task::set_priority(task_priority::background);
+            this_task::yield();
+            background_ran = true;
+        });
+        task::spawn([&] {
+            this_task::set_priority(task_priority::critical);
+            while (!background_ran) {
+                this_task::yield();
+            }
+        });
+        kernel::wait_for_tasks();
+        // the 20 normal tasks would all run between yields without priority
+        EXPECT_LE(most_behind, 4);
+        EXPECT_TRUE(background_ran);
+    });
+}
+
+TEST(Task, BusyPoll) {
+    task::main([]{
+        kernel::set_busy_poll(milliseconds{2});
+        // timers still fire, during and after the poll budget
+        for (auto ms : {1, 5}) {
+            const auto start = steady_clock::now();
+            this_task::sleep_for(milliseconds{ms});
+            EXPECT_GE(steady_clock::now() - start, milliseconds{ms});
+        }
+        // and wakeups from other threads are seen while polling
+        qutex q;
+        rendez r;
+        bool woken = false;
+        std::thread waker = task::spawn_thread([&] {
+            std::lock_guard<qutex> lk{q};
+            woken = true;
+            r.wakeup();
+        });
+        {
+            std::unique_lock<qutex> lk{q};
+            r.sleep(lk, [&] { return woken; });
+        }
+        kernel::set_busy_poll(kernel::duration::zero());
+        waker.join();
+    });
+}
+
+TEST(Task, BusyPollNotStalled) {
+    const auto before = metrics::global.aggregate();
+    kernel::set_watchdog(milliseconds{20});
+    task::main([]{
+        // spinning through the whole sleep is busy polling, not a stall
+        kernel::set_busy_poll(milliseconds{200});
+        this_task::sleep_for(milliseconds{100});
+        kernel::set_busy_poll(kernel::duration::zero());
+    });
+    kernel::set_watchdog(kernel::duration::zero());
+    const auto m = metrics::global.aggregate() - before;
+    EXPECT_EQ(0u, metrics::value<metrics::counter>(m, "watchdog", "stalls"));
+}
+
+TEST(Task, SleepSubMillisecond) {
+    task::main([]{
+        // a task waiting on a pipe makes the scheduler block in epoll
+        int fds[2];
+        ASSERT_EQ(0, pipe(fds));
+        task waiter = task::spawn([=] {
+            fdwait(fds[0], 'r');
+        });
+        this_task::yield();
+        std::vector<kernel::duration> slept;
+        for (int i=0; i<21; ++i) {
+            // sleep_for counts from the loop's cached time, which can
+            // be a little behind the clock
+            const auto start = kernel::now();
+            this_task::sleep_for(microseconds{250});
+            slept.push_back(steady_clock::now() - start);
+        }
+        std::sort(slept.begin(), slept.end());
+        EXPECT_GE(slept.front(), microseconds{250});
+        // timeouts used to be rounded up to whole milliseconds
+        EXPECT_LT(slept[slept.size() / 2], microseconds{900});
+        waiter.cancel();
+        waiter.join();
+        close(fds[0]);
+        close(fds[1]);
+    });
+}
+
+TEST(Task, RunBudget) {
+    task::main([]{
+        kernel::set_run_budget(64);
+        int fds[2];
+        ASSERT_EQ(0, pipe(fds));
+        int steps = 0;
+        int woke_at = -1;
+        task::spawn([&] {
+            fdwait(fds[0], 'r');
+            woke_at = steps;
+        });
+        this_task::yield();
+        for (int i=0; i<100; ++i) {
+            task::spawn([&] {
+                for (int j=0; j<50; ++j) {
+                    ++steps;
+                    this_task::yield();
+                }
+            });
+        }
+        const auto before = kernel::loop_stats();
+        ASSERT_EQ(1, write(fds[1], "x", 1));
+        kernel::wait_for_tasks();
+        const auto after = kernel::loop_stats();
+        // the ready queue never empties, only the budget polls for io
+        EXPECT_GE(woke_at, 0);
+        EXPECT_LT(woke_at, 1000);
+        EXPECT_GT(after.budget_polls, before.budget_polls);
+        EXPECT_GT(after.iterations, before.iterations);
+        EXPECT_GT(after.events, before.events);
+        EXPECT_GE(after.batch, 16u);
+        kernel::set_run_budget(0);
+        close(fds[0]);
+        close(fds[1]);
+    });
+}
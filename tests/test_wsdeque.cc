@@ -0,0 +1,81 @@
+#include "gtest/gtest.h"
+#include "ten/wsdeque.hh"
+#include <thread>
+#include <vector>
+#include <atomic>
+
+using namespace ten;
+
+TEST(WorkStealingDeque, Test) {
+    wsdeque<intptr_t> q{2};
+    q.push(20);
+    q.push(21);
+    q.push(22);
+    q.push(23);
+    EXPECT_EQ(4, q.size());
+    intptr_t v = 0;
+    // owner pops newest
+    ASSERT_TRUE(q.pop(v));
+    EXPECT_EQ(23, v);
+
+    // thieves steal oldest
+    ASSERT_TRUE(q.steal(v));
+    EXPECT_EQ(20, v);
+
+    ASSERT_TRUE(q.pop(v));
+    EXPECT_EQ(22, v);
+
+    ASSERT_TRUE(q.steal(v));
+    EXPECT_EQ(21, v);
+
+    ASSERT_TRUE(!q.pop(v));
+    ASSERT_TRUE(!q.steal(v));
+    EXPECT_TRUE(q.empty());
+
+    // the owner sees what is left, oldest first
+    for (intptr_t i=30; i<35; ++i) q.push(i);
+    ASSERT_TRUE(q.steal(v));
+    ASSERT_TRUE(q.pop(v));
+    std::vector<intptr_t> left;
+    q.for_each([&](intptr_t i) { left.push_back(i); });
+    EXPECT_EQ((std::vector<intptr_t>{31, 32, 33}), left);
+}
+
+TEST(WorkStealingDeque, Threaded) {
+    static const intptr_t nitems = 100000;
+    wsdeque<intptr_t> q;
+    std::atomic<bool> done{false};
+    std::atomic<intptr_t> sum{0};
+    std::atomic<intptr_t> count{0};
+    std::vector<std::thread> thieves;
+    for (int i=0; i<4; ++i) {
+        thieves.emplace_back([&] {
+            intptr_t v;
+            while (!done || !q.empty()) {
+                if (q.steal(v)) {
+                    sum += v;
+                    ++count;
+                }
+            }
+        });
+    }
+    intptr_t v;
+    for (intptr_t i=1; i<=nitems; ++i) {
+        q.push(i);
+        if (i % 3 == 0 && q.pop(v)) {
+            sum += v;
+            ++count;
+        }
+    }
+    while (q.pop(v)) {
+        sum += v;
+        ++count;
+    }
+    done = true;
+    for (auto &t : thieves) {
+        t.join();
+    }
+    // every item taken exactly once
+    EXPECT_EQ(nitems, count);
+    EXPECT_EQ(nitems * (nitems + 1) / 2, sum);
+}